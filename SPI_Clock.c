@@ -19,7 +19,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 
 This program will drive a 7 digit clock display driven by a MAX6951 connected
-to a Raspberry Pi's SPI port.
+to a Raspberry Pi's SPI port. It can show local time, UTC or sidereal time
+(see timesource.h).
 
 Digit 0 through 6 represent the time digits starting from tens of hours (0)
 through a tenth of a second (6).
@@ -34,6 +35,12 @@ DIN: pin 21: SPI0_MOSI / GPIO 10
 CLK: pin 23: SPI0_SCLK / GPIO 11
 !CS: pin 24: SPI0_CE0_N / GPIO 8
 
+The clock board will also supply 5 volts to pins 2 and 4 to power the Pi.
+
+It will additionally break out the UART0 TX and RX pins to a 3 pin header.
+For the RX pin, it has a diode + pull-up level shifter (with the pull-up from
+3V3 on pin 1).
+
 */
 
 // There is some latency in the system that must be accounted for.
@@ -46,12 +53,85 @@ CLK: pin 23: SPI0_SCLK / GPIO 11
 #define SECOND_IN_NANOS (1000L * 1000L * 1000L)
 #define TENTH_IN_NANOS (SECOND_IN_NANOS / 10)
 #define HUNDREDTH_IN_NANOS (SECOND_IN_NANOS / 100)
+#define MINUTE_IN_NANOS (60LL * SECOND_IN_NANOS)
+
+// Deadline accounting. Every tick has a target - the instant it is meant
+// to display. A tick is late if we start on it more than LATE_SLOP after
+// that, and ticks were skipped if by then the nearest boundary is a later one.
+#define LATE_SLOP (HUNDREDTH_IN_NANOS)
+// The late policy will render every missed tick, but only this far back.
+// Beyond that, we give up and jump to the present.
+#define LATE_LIMIT (SECOND_IN_NANOS)
+// The degrade policy counts misses over windows this long.
+#define MISS_WINDOW (60LL * SECOND_IN_NANOS)
+
+// What to do when a tick is late
+#define POLICY_LATE 0 // render the missed tick anyway, then catch up
+#define POLICY_SKIP 1 // render whatever tick it is now
+#define POLICY_DEGRADE 2 // skip, and drop the tenths if it keeps happening
+
+// SCHED_DEADLINE for the display thread. The handler's cost is measured over
+// the first DL_CALIBRATION_TICKS ticks (under SCHED_FIFO), and the runtime we
+// ask for is that times DL_RUNTIME_MARGIN.
+#define DL_CALIBRATION_TICKS 50
+#define DL_RUNTIME_MARGIN 2
+#define DL_RUNTIME_MIN (50L * 1000L)
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+// The counters are exported here every STATS_INTERVAL seconds, or on SIGUSR1.
+// The sidereal clock has its own, so that both can run at once.
+#define STATS_FILE "/run/spiclock.stats"
+#define SIDEREAL_STATS_FILE "/run/side_clock.stats"
+#define STATS_INTERVAL (60)
+
+// With -n, how often (seconds) the housekeeping asks the kernel how NTP is
+// doing, and how much estimated error (usec) is too much by default.
+#define NTP_INTERVAL (16)
+#define NTP_THRESHOLD (50L * 1000L)
+#define NTP_SYNCED 0
+#define NTP_UNSYNC 1 // the kernel says it isn't synchronized
+#define NTP_ERROR 2 // it is, but the estimated error is over the threshold
+
+// Under systemd's watchdog (see notify.h), the housekeeping only feeds it
+// while the display thread is no more than this late for its next wakeup,
+// and has missed fewer ticks than the degrade threshold since last time.
+#define WATCHDOG_GRACE (SECOND_IN_NANOS)
+
+// With -F, the next second's digits go into the hidden plane this long
+// before the boundary. See update_display().
+#define FLIP_LEAD (20L * 1000L * 1000L)
+
+// Timer slack, in usec, for the housekeeping (the stats file). None of it
+// is visible, so it may as well wait for the CPU to be awake anyway.
+#define HOUSEKEEPING_SLACK (1000L * 1000L)
+
+// Every tick is recorded here. See trace.h and SPI_Trace.c.
+#define TRACE_FILE "/run/spiclock.trace"
+#define SIDEREAL_TRACE_FILE "/run/side_clock.trace"
+
+// Where to look for upcoming leap seconds (see leap.h), unless -Y says.
+#define LEAP_FILE "/usr/share/zoneinfo/leap-seconds.list"
 
+// Commands come in here (see control.h), unless -Q says otherwise.
+#define CONTROL_FILE "/run/spiclock.sock"
+#define SIDEREAL_CONTROL_FILE "/run/side_clock.sock"
+
+// Text messages (-m, or "text" on the control socket) move along a digit
+// this often, and one that fits stays up for this many steps.
+#define MSG_STEP (250L * 1000L * 1000L)
+#define MSG_HOLD 12
+#define MSG_MAX 64
+
+#define _GNU_SOURCE
 #define _BSD_SOURCE
 #define _DEFAULT_SOURCE
 #define _POSIX_C_SOURCE 199309L
+#define _FILE_OFFSET_BITS 64
 
 #include <unistd.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -61,11 +141,27 @@ CLK: pin 23: SPI0_SCLK / GPIO 11
 #include <sched.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/timex.h>
 #include <linux/spi/spidev.h>
 
+#include "trace.h"
+#include "spi0.h"
+#include "perf_stats.h"
+#include "timetable.h"
+#include "timesource.h"
+#include "control.h"
+#include "stopwatch.h"
+#include "font.h"
+#include "compositor.h"
+#include "events.h"
+#include "config.h"
+#include "notify.h"
+
 #define _BV(n) (1 << n)
 
 // The MAX6951 registers and their bits
@@ -78,6 +174,8 @@ CLK: pin 23: SPI0_SCLK / GPIO 11
 #define MAX_REG_CONFIG_E _BV(3)
 #define MAX_REG_CONFIG_B _BV(2)
 #define MAX_REG_CONFIG_S _BV(0)
+// For -F: on, fast blinking, and reset the blink timer (see update_display())
+#define MAX_REG_CONFIG_FLIP (MAX_REG_CONFIG_S | MAX_REG_CONFIG_E | MAX_REG_CONFIG_B | MAX_REG_CONFIG_T)
 #define MAX_REG_TEST 0x07
 // P0 and P1 are planes - used when blinking is turned on
 // or the mask with the digit number 0-7. On the hardware, 0-6
@@ -88,19 +186,7 @@ CLK: pin 23: SPI0_SCLK / GPIO 11
 #define MAX_REG_MASK_P0 0x20
 #define MAX_REG_MASK_P1 0x40
 #define MAX_REG_MASK_BOTH (MAX_REG_MASK_P0 | MAX_REG_MASK_P1)
-// When decoding is turned off, this is the bit mapping.
-// Segment A is at the top, the rest proceed clockwise around, and
-// G is in the middle. DP is the decimal point.
-// When decoding is turned on, bits 0-3 are a hex value, 4-6 are ignored,
-// and DP is as before.
-#define MASK_DP _BV(7)
-#define MASK_A _BV(6)
-#define MASK_B _BV(5)
-#define MASK_C _BV(4)
-#define MASK_D _BV(3)
-#define MASK_E _BV(2)
-#define MASK_F _BV(1)
-#define MASK_G _BV(0)
+// The segment masks (MASK_A etc.) are in font.h.
 
 // Digit 7 has the two colons and the AM & PM lights
 #define MASK_COLON_HM (MASK_E | MASK_F)
@@ -120,86 +206,624 @@ CLK: pin 23: SPI0_SCLK / GPIO 11
 
 // These things all get accessed across the thread boundary
 volatile int spi_fd;
-volatile timer_t timer_id;
 volatile unsigned char ampm = 1; // 0 for a 24 hour display
+volatile int time_source = TS_CIVIL;
+// The clock ticks are kept on. CLOCK_TAI with a leap mode.
+clockid_t tick_clock = CLOCK_REALTIME;
 volatile unsigned char colon = 1;
 volatile unsigned char colon_blink = 0;
 volatile unsigned char tenth_enable = 1;
+volatile unsigned char hhmm = 0; // just hours and minutes
+volatile unsigned char hw_blink = 0; // let the MAX6951 blink the colons
+volatile unsigned char flip_enable = 0; // double buffer in the two planes
+volatile unsigned char perf_enable = 0;
+volatile unsigned char stopwatch = 0; // a stopwatch instead of a clock
+volatile unsigned char ntp_enable = 0; // show when NTP isn't keeping us right
+volatile long ntp_threshold = NTP_THRESHOLD;
+// What the housekeeping last found out. The display thread only looks.
+volatile unsigned char ntp_state = NTP_SYNCED;
+volatile long ntp_esterror = 0, ntp_maxerror = 0; // usec
+volatile unsigned long stat_ntp_changes = 0;
+volatile unsigned long stat_events = 0;
+volatile int rt_policy = SCHED_RR;
+volatile int rt_priority = -1; // -1 for the middle of the range
+volatile unsigned char deadline_enable = 0;
+volatile int cpu_pin = -1;
+// How the display thread ended up being scheduled
+char sched_report[160] = "";
+volatile unsigned char miss_policy = POLICY_SKIP;
+volatile unsigned int miss_threshold = 10; // misses per window before we degrade
+volatile unsigned char degraded = 0;
 
-static void write_reg(unsigned char reg, unsigned char data) {
-	// We write two bytes - the register number and then the data.
-	unsigned char msgbuf[2];
-	msgbuf[0] = reg;
-	msgbuf[1] = data;
-	struct spi_ioc_transfer tx_xfr;
-	memset(&tx_xfr, 0, sizeof(tx_xfr));
-	tx_xfr.tx_buf = (unsigned long)msgbuf; // Stupid Linux, why is it not a pointer?
-	// tx_xfr.rx_buf = (unsigned long)NULL; // redundant
-	tx_xfr.len = sizeof(msgbuf);
-	if (ioctl(spi_fd, SPI_IOC_MESSAGE(1), &tx_xfr) < 0) {
-		perror("ioctl(SPI_IOC_MESSAGE(1))");
+// Tick statistics. Only the display thread writes these.
+volatile unsigned long stat_ticks = 0;
+volatile unsigned long stat_late = 0;
+volatile unsigned long stat_skipped = 0;
+volatile unsigned long stat_early = 0;
+volatile unsigned long stat_kicks = 0; // woken by a signal rather than the timer
+volatile unsigned long stat_degrades = 0;
+volatile unsigned long stat_wakeups = 0;
+volatile unsigned long stat_housekeeping = 0;
+volatile unsigned long stat_coalesced = 0; // housekeeping that rode along on a display wakeup
+volatile unsigned long stat_handler_max = 0; // usec from wakeup until the frame is out
+// For the stopwatch: usec from a command's arrival until the display shows it
+volatile unsigned long stat_commands = 0;
+volatile unsigned long stat_commands_bad = 0;
+volatile unsigned long long stat_command_latency = 0; // the total
+volatile unsigned long stat_command_latency_max = 0;
+volatile unsigned long stat_command_over = 0; // took longer than a frame
+// For the countdown: how far from its target the zero frame landed, in ns
+volatile unsigned long stat_countdown_zeros = 0;
+volatile long long stat_countdown_error = 0; // the last one
+volatile long long stat_countdown_error_max = 0; // and the worst, either way
+
+// These belong to the display thread. Times are nanoseconds since the epoch.
+static long long next_tick = 0; // the tick we will wake up for next
+static long long last_tick = 0; // the tick we last rendered
+static unsigned char woke_kicked = 0; // this wakeup was a signal's, not the timer's
+static unsigned char blink_synced = 0;
+static long long bright_next = 0; // when to look at the brightness schedule again
+static int bright_current = -1;
+static long long off_next = 0; // when to look at the off windows again
+static unsigned char off_now = 0; // in an off window
+static unsigned char display_off = 0; // and the chip has been shut down for it
+static unsigned char flip_next = 0; // the next tick can be flipped in, so wake up early for it
+// The decode mode the chip has now. It keeps its registers across a restart,
+// so to start with it could be anything: 0xff is a mode we never use (the
+// misc digit is never decoded), so the first frame always writes it.
+static unsigned char flip_decode = 0xff;
+static unsigned char countdown_blinking = 0; // the countdown is done, and blinking
+static unsigned char ntp_shown = NTP_SYNCED; // what the NTP layer says
+// Events (-E, see events.h)
+static long long ev_next = 0; // when the next one is due, or 0 for none
+static long long blink_until = 0; // an event's blink goes on until then
+static unsigned char blinking = 0; // and the chip is doing it
+static unsigned char blink_decode = 0; // the decode mode plane 1's blanks are for
+static long long off_wake_until = 0; // an event has the display on in an off window until then
+static int bright_pending = -1; // a brightness from an event or a new config, for the next frame
+// A text message. It starts on the next wakeup after it's set.
+static unsigned char msg_glyphs[MSG_MAX];
+static int msg_len = 0;
+static unsigned char msg_pending = 0;
+static long long msg_start = 0, msg_end = 0; // 0 when there's none up
+static unsigned char msg_regs[8]; // what the digits have now
+static const unsigned char msg_mask[LAYER_DIGITS] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+// When the housekeeping is next due (ns since the epoch), and who does it.
+static volatile long long housekeeping_due = 0;
+static volatile unsigned long housekeeping_slack = HOUSEKEEPING_SLACK;
+static pthread_t main_tid;
+// When the display thread is next due to wake up, for the watchdog. On the
+// tick clock, or CLOCK_MONOTONIC for the stopwatch. 0 if it's waiting for
+// a command.
+static volatile long long display_due = 0;
+static volatile unsigned long stat_watchdog = 0, stat_watchdog_withheld = 0;
+static pthread_t display_tid;
+// For a simulation (-V), the virtual clock. 0 means use the real one.
+static long long sim_clock = 0;
+static long long window_start = 0;
+static unsigned long window_misses = 0;
+
+// sched_setattr() has no glibc wrapper (until very recently, and then under
+// this struct's name), so we carry our own copy of the kernel's struct.
+struct dl_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime; // all ns
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+// One tick's worth of register writes, collected so that they can be
+// sent (and traced) together.
+#define FRAME_MAX TRACE_MAX_REGS
+struct frame {
+	unsigned char count;
+	unsigned char regs[FRAME_MAX][2]; // register, data
+};
+
+static volatile unsigned long stat_frame_overflow = 0;
+static volatile unsigned long stat_spi0_timeouts = 0;
+
+// A frame that's full has lost a write, which is a bug. Better that than
+// running over the stack.
+static void frame_add(struct frame *f, unsigned char reg, unsigned char data) {
+	if (f->count == FRAME_MAX) {
+		stat_frame_overflow++;
+		return;
+	}
+	f->regs[f->count][0] = reg;
+	f->regs[f->count][1] = data;
+	f->count++;
+}
+
+static void sim_frame(const struct frame *f);
+
+// Send the frame, either through spidev or straight to the controller
+// (or, for a simulation, print it).
+static void commit_frame(const struct frame *f) {
+	if (sim_clock) {
+		sim_frame(f);
+		return;
+	}
+	if (spi0_regs != NULL) {
+		if (spi0_commit((const unsigned char (*)[2])f->regs, f->count) == 0) return;
+		// The controller has stopped finishing transfers. Rather than hang
+		// at real time priority, go back to spidev for good (it's still
+		// open), and send the frame again that way. An emulated one has
+		// nothing to go back to.
+		stat_spi0_timeouts++;
+		fprintf(stderr, "SPI0 controller timed out; %s\n", spi0_emul?"dropping the frame":"going back to spidev");
+		if (spi0_emul) return;
+		spi0_regs = NULL;
+	}
+	// One ioctl for the whole frame. Each register is its own two byte
+	// transfer, and chip select has to go up in between so the MAX6951
+	// latches each one. On the last transfer, cs_change would mean the
+	// opposite, so that one's left alone.
+	struct spi_ioc_transfer tx_xfr[FRAME_MAX];
+	memset(tx_xfr, 0, sizeof(tx_xfr));
+	for(int i = 0; i < f->count; i++) {
+		tx_xfr[i].tx_buf = (unsigned long)f->regs[i]; // Stupid Linux, why is it not a pointer?
+		// tx_xfr[i].rx_buf = (unsigned long)NULL; // redundant
+		tx_xfr[i].len = 2;
+		tx_xfr[i].cs_change = (i != f->count - 1);
+	}
+	if (ioctl(spi_fd, SPI_IOC_MESSAGE(f->count), tx_xfr) < 0) {
+		perror("ioctl(SPI_IOC_MESSAGE)");
 		exit(1);
 	}
 }
 
+static void write_reg(unsigned char reg, unsigned char data) {
+	struct frame f;
+	f.count = 0;
+	frame_add(&f, reg, data);
+	commit_frame(&f);
+}
+
 static void cleanup(int signo) {
+	notify_send("STOPPING=1");
 	write_reg(MAX_REG_CONFIG, 0); // sleep now.
 	exit(1);
 }
 
+// The control thread's kick. All it has to do is interrupt the wait.
+static void kick(int signo) {
+}
+
 static void usage() {
-	printf("Usage: clock [-a][-B][-b n][-c][-d][-t]\n");
+	printf("Usage: clock [-A cpu][-C when][-D][-a][-B][-b n][-c][-d][-e][-E file][-f file][-F][-H][-i sched][-K][-l n][-L mode][-m text][-M file][-n][-N usec][-o windows][-p prio][-P policy][-Q file][-r file][-S][-t][-u][-U file][-V when[,hours]][-w usec][-W][-Y file][-z zones][-Z secs]\n");
 	printf("   -2 : 24 hour display mode (instead of AM/PM)\n");
+	printf("   -a : apparent rather than mean sidereal time. Implies -S.\n");
+	printf("   -A : pin the display thread to this CPU\n");
+	printf("   -C : count down to when (local YYYY-MM-DD HH:MM[:SS], or @seconds). Add ,hold\n");
+	printf("        (the default), ,blink or ,up for what to do at zero\n");
+	printf("   -D : run the display thread under SCHED_DEADLINE, if the kernel will let us\n");
 	printf("   -B : blink the colons\n");
 	printf("   -b : set brightness 0-15\n");
 	printf("   -c : turn colons off\n");
 	printf("   -d : Don't daemonize (remain in foreground)\n");
+	printf("   -E : alarms and other events from this file (see events.h). Read again when\n");
+	printf("        it changes\n");
+	printf("   -e : count cycles, cache misses etc. for each stage of a tick (see the stats)\n");
+	printf("   -F : write each second into the hidden plane early and flip it in at the boundary\n");
+	printf("        (whole second ticks only; not with -K)\n");
+	printf("   -H : show only hours and minutes, and only wake up once a minute\n");
+	printf("   -i : brightness schedule, like 07:00=15,22:30=3/45 (ramp over 45 minutes)\n");
+	printf("   -K : blink the colons with the MAX6951's own blink timer\n");
+	printf("   -l : Longitude east (negative for west) for sidereal time. Implies -S. Default is 0.\n");
+	printf("   -L : leap seconds: tai shows 23:59:60, smear[:hours] spreads it over a window\n");
+	printf("        centered on it (default 24 hours). Local time and UTC only.\n");
+	printf("   -m : show this message first\n");
+	printf("   -M : drive the SPI0 registers directly. Give /dev/mem, or a file to emulate them\n");
+	printf("   -n : show on the misc digit when NTP isn't synchronized (G) or is off by more\n");
+	printf("        than the threshold (DP)\n");
+	printf("   -N : the threshold for -n, in usec of estimated error (default 50000). Implies -n.\n");
+	printf("   -o : turn the display off during these times, like 01:00-06:00,12:00-13:00\n");
+	printf("   -p : use SCHED_FIFO at this priority (default SCHED_RR in the middle)\n");
+	printf("        This is also what -D falls back to.\n");
+	printf("   -P : late tick policy: late, skip (default) or degrade[:n]\n");
+	printf("        degrade drops the tenths after n misses a minute (default 10)\n");
+	printf("   -Q : the control socket (default " CONTROL_FILE ",\n");
+	printf("        or " SIDEREAL_CONTROL_FILE " for sidereal time. \"\" for none)\n");
+	printf("   -r : record the tick trace in this file (default " TRACE_FILE ",\n");
+	printf("        or " SIDEREAL_TRACE_FILE " for sidereal time. \"\" for none)\n");
+	printf("   -S : show sidereal time (the default when run as side_clock)\n");
 	printf("   -t : turn tenth of a second digit off\n");
+	printf("   -u : show UTC instead of local time\n");
+	printf("   -U : sidereal time by IAU 2006, with UT1-UTC from this IERS finals file\n");
+	printf("        (\"\" for none). Implies -S.\n");
+	printf("   -V : simulate from when (local YYYY-MM-DD HH:MM[:SS], or @seconds) for this many\n");
+	printf("        hours (default 24), printing each frame instead of sending it\n");
+	printf("   -w : timer slack in usec for the housekeeping (default 1 second)\n");
+	printf("   -W : be a stopwatch instead, controlled with start, stop, lap and reset\n");
+	printf("        sent to the control socket\n");
+	printf("   -Y : leap-seconds.list file for upcoming leaps (default " LEAP_FILE ")\n");
+	printf("   -z : take turns showing these time zones, like local,UTC,Asia/Tokyo (at most 4)\n");
+	printf("   -Z : seconds to show each zone (default 5)\n");
 }
 
-static void schedule_timer() {
-	struct timespec now;
-	if (clock_gettime(CLOCK_REALTIME, &now)) {
-		perror("clock_gettime");
-		exit(1);
+// A time, in local time (YYYY-MM-DD HH:MM[:SS[.sss]]) or as @seconds[.sss]
+// since the epoch. Returns it in ns, or 0 if it's no good. Anything after
+// it (like a ,suffix) is left for the caller.
+static long long parse_when(const char *p) {
+	long long whole;
+	const char *frac = NULL;
+	if (*p == '@') {
+		char *end;
+		whole = strtoll(p + 1, &end, 10);
+		if (*end == '.') frac = end;
+	} else {
+		struct tm lt;
+		memset(&lt, 0, sizeof(lt));
+		int len = 0;
+		int n = sscanf(p, "%d-%d-%d%*[ T]%d:%d:%d%n", &lt.tm_year, &lt.tm_mon, &lt.tm_mday, &lt.tm_hour, &lt.tm_min,
+			&lt.tm_sec, &len);
+		if (n < 5) return 0;
+		lt.tm_year -= 1900;
+		lt.tm_mon -= 1;
+		lt.tm_isdst = -1;
+		whole = (long long)mktime(&lt);
+		// Only a fraction of the seconds field, not of anything after.
+		if (n == 6 && p[len] == '.') frac = p + len;
 	}
-	// We want to round to the nearest tenth. We can start by tuncating to the nearest
-	// hundredth
-	unsigned int hundredth_val = (unsigned int)(now.tv_nsec / HUNDREDTH_IN_NANOS);
-	// We actually want the *next* tenth of a second.
-	unsigned int tenth_val = (hundredth_val + 5) / 10 + 1;
-	while (tenth_val >= 10) {
-		now.tv_sec++;
-		tenth_val -= 10;
-	}
-	// We want the alarm to go off a little early (FUDGE).
-	if (tenth_val != 0) {
-		now.tv_nsec = tenth_val * TENTH_IN_NANOS - FUDGE;
+	long long ns = whole * SECOND_IN_NANOS;
+	if (frac != NULL) {
+		long long place = SECOND_IN_NANOS / 10;
+		for(frac++; *frac >= '0' && *frac <= '9' && place > 0; frac++, place /= 10) ns += (*frac - '0') * place;
+	}
+	return ns;
+}
+
+// A countdown target: when[,hold|blink|up]. Returns 0 if it's good.
+static int countdown_parse(const char *p, long long *target, unsigned char *after) {
+	*target = parse_when(p);
+	if (*target == 0) return -1;
+	const char *mode = strchr(p, ',');
+	*after = CD_HOLD;
+	if (mode == NULL || !strcmp(mode + 1, "hold")) return 0;
+	if (!strcmp(mode + 1, "blink")) {
+		*after = CD_BLINK;
+	} else if (!strcmp(mode + 1, "up")) {
+		*after = CD_UP;
 	} else {
-		// Backing up a bit from zero means crossing the second boundary.
-		now.tv_nsec = SECOND_IN_NANOS - FUDGE;
-		now.tv_sec--;
-	}
-	// We want to individually schedule each one rather than use the interval,
-	// because it gives us better control in the face of variable response latency.
-	// We will simply specify exactly when we desire to be woken up every time.
-	struct itimerspec my_itimerspec;
-	my_itimerspec.it_interval.tv_sec = 0;
-	my_itimerspec.it_interval.tv_nsec = 0;
-	my_itimerspec.it_value = now;
-	if (timer_settime(timer_id, TIMER_ABSTIME, &my_itimerspec, NULL) < 0) {
-		perror("timer_settime");
-		exit(1);
+		return -1;
+	}
+	return 0;
+}
+
+// How often we need to wake up depends on what the smallest digit on
+// display is - and on whether we have to blink the colons ourselves.
+static long long tick_period() {
+	if (hhmm) {
+		// Zones change on a second boundary, too.
+		if (zone_count > 1 && time_source == TS_ZONES) return SECOND_IN_NANOS;
+		return (colon && colon_blink && !hw_blink)?SECOND_IN_NANOS:MINUTE_IN_NANOS;
+	}
+	if (!tenth_enable || degraded) return SECOND_IN_NANOS;
+	return TENTH_IN_NANOS;
+}
+
+static void count_misses(long long tick, unsigned long misses) {
+	if (tick - window_start >= MISS_WINDOW) {
+		// A clean window gets us out of trouble.
+		if (degraded && window_misses < miss_threshold) {
+			degraded = 0;
+		}
+		window_start = tick;
+		window_misses = 0;
+	}
+	window_misses += misses;
+	if (miss_policy == POLICY_DEGRADE && !degraded && window_misses >= miss_threshold) {
+		degraded = 1;
+		stat_degrades++;
 	}
 }
 
-static void update_display(union sigval ignore) {
+// Figure out which tick we ought to render, given that we were aimed
+// at next_tick and it's now now_ns. Returns 0 if it isn't time yet.
+// What happened is noted in flags for the trace.
+static ALWAYS_INLINE long long pick_tick(int src, long long now_ns, long long period, unsigned short *flags) {
+	// The tick that will be showing by the time the frame lands.
+	long long tick = ts_floor(src, now_ns + FUDGE, period);
 
+	if (next_tick == 0) { // first time through
+		*flags |= TRACE_FIRST;
+		return tick;
+	}
+
+	// Sidereal boundaries come out of floating point, so working the same
+	// one out twice can come out a hair different.
+	if (TS_IS_SIDEREAL(src) && llabs(tick - next_tick) < period / 2) tick = next_tick;
+
+	unsigned long misses = 0;
+	if (now_ns - next_tick > LATE_SLOP) {
+		stat_late++;
+		misses++;
+		*flags |= TRACE_LATE;
+	}
+	if (tick > next_tick) {
+		unsigned long skipped = (unsigned long)((tick - next_tick) / period);
+		stat_skipped += skipped;
+		misses += skipped;
+		if (miss_policy == POLICY_LATE && tick - next_tick <= LATE_LIMIT) {
+			tick = next_tick; // show the one we missed. We'll catch up.
+			*flags |= TRACE_CATCHUP;
+		} else {
+			*flags |= TRACE_SKIPPED;
+		}
+	} else if (tick < next_tick) {
+		// We're early. Rounding to the nearest tick would have shown the
+		// previous one twice. Unless the clock has been stepped backwards,
+		// just go back to sleep. Being kicked awake (a command, a new
+		// config) isn't the timer going off early, and is counted apart.
+		if (woke_kicked) {
+			*flags |= TRACE_KICK;
+		} else {
+			stat_early++;
+			*flags |= TRACE_EARLY;
+		}
+		if (next_tick - tick <= period) return 0;
+	}
+	count_misses(tick, misses);
+	return tick;
+}
+
+// Fill in and publish the trace record for a tick. The commit times
+// are trace_clock() readings, which we turn into wall clock time by way
+// of the wakeup.
+static void trace_tick(struct trace_record *rec, long long target, long long wakeup, uint32_t wake_clock,
+		uint32_t start_clock, uint32_t end_clock, unsigned short flags, const struct frame *f) {
+	if (rec == NULL) return;
+	rec->target = target;
+	rec->wakeup = wakeup;
+	rec->commit_start = wakeup + (long long)(uint32_t)(start_clock - wake_clock) * 1000;
+	rec->commit_end = wakeup + (long long)(uint32_t)(end_clock - wake_clock) * 1000;
+	rec->flags = flags;
+	rec->nregs = f?f->count:0;
+	if (f) memcpy(rec->regs, f->regs, f->count * 2);
+	trace_end(rec);
+}
+
+// Send the frame and account for it. Returns when it was done.
+static long long finish_tick(struct trace_record *rec, long long tick, long long wakeup, uint32_t wake_clock,
+		unsigned short flags, const struct frame *f) {
+	perf_mark(STAGE_ENCODE);
+	uint32_t start_clock = trace_clock();
+	commit_frame(f);
+	uint32_t end_clock = trace_clock();
+	trace_tick(rec, tick, wakeup, wake_clock, start_clock, end_clock, flags, f);
+	perf_mark(STAGE_COMMIT);
+	if ((uint32_t)(end_clock - wake_clock) > stat_handler_max) stat_handler_max = (uint32_t)(end_clock - wake_clock);
+	return wakeup + (long long)(uint32_t)(end_clock - wake_clock) * 1000;
+}
+
+// With -F, having woken up early to stage the next digits, wait for the
+// tick itself. Returns the time then, and the trace clock in *wake_clock.
+static long long wait_for_tick(long long tick, uint32_t *wake_clock) {
+	long long wake = tick - FUDGE;
+	if (sim_clock) {
+		if (wake > sim_clock) sim_clock = wake;
+		*wake_clock = trace_clock();
+		return sim_clock;
+	}
+	struct timespec wake_spec;
+	wake_spec.tv_sec = (time_t)(wake / SECOND_IN_NANOS);
+	wake_spec.tv_nsec = (long)(wake % SECOND_IN_NANOS);
+	int err;
+	while((err = clock_nanosleep(tick_clock, TIMER_ABSTIME, &wake_spec, NULL)) == EINTR) ;
 	struct timespec now;
-	if (clock_gettime(CLOCK_REALTIME, &now)) {
-		perror("clock_gettime");
+	if (err != 0 || clock_gettime(tick_clock, &now)) {
+		if (err) errno = err;
+		perror("clock_nanosleep");
 		exit(1);
 	}
+	*wake_clock = trace_clock();
+	return (long long)now.tv_sec * SECOND_IN_NANOS + now.tv_nsec;
+}
+
+// Put up a text message, from the next wakeup.
+static void msg_set(const char *text) {
+	msg_len = glyph_text(text, msg_glyphs, MSG_MAX);
+	msg_pending = 1;
+}
+
+// How many steps the message takes. One that fits stays put. A longer one
+// comes in from the right and goes off the left.
+static int msg_steps() {
+	return (msg_len <= DIGIT_MISC)?MSG_HOLD:msg_len + DIGIT_MISC + 1;
+}
+
+// Do whatever events are due at tick. Only when ev_next comes around.
+static void events_fire(long long tick) {
+	long long t = leap_to_posix(tick);
+	while(ev_count && ev_top() <= t) {
+		const struct event *e = &ev_live[ev_heap[0]].e;
+		long long until = tick;
+		switch(e->effect) {
+			case EV_BLINK:
+				blink_until = until = tick + e->arg * SECOND_IN_NANOS;
+				break;
+			case EV_TEXT:
+				msg_set(e->text);
+				until = tick + msg_steps() * MSG_STEP;
+				break;
+			case EV_BRIGHT:
+				bright_pending = e->arg;
+				break;
+		}
+		// In an off window, the display comes on for it.
+		if (until > off_wake_until) off_wake_until = until;
+		stat_events++;
+		ev_done(t);
+	}
+	ev_next = ev_count?leap_from_posix(ev_top()):0;
+}
+
+// A new configuration (-f, see config.h). The schedules start over from
+// whatever tick it is.
+static void __attribute__((noinline)) config_adopt() {
+	const struct config *c = __atomic_load_n(&cfg_published, __ATOMIC_ACQUIRE);
+	long long period = tick_period();
+	ampm = c->ampm;
+	colon = c->colon;
+	colon_blink = c->colon_blink;
+	tenth_enable = c->tenth_enable;
+	hhmm = c->hhmm;
+	if (hw_blink != c->hw_blink) blink_synced = 0;
+	hw_blink = c->hw_blink;
+	ntp_enable = c->ntp_enable;
+	ntp_threshold = c->ntp_threshold;
+	memcpy(bright_table, c->bright_table, sizeof(bright_table));
+	bright_count = c->bright_count;
+	bright_next = 0;
+	if (!bright_count) bright_pending = c->brightness;
+	memcpy(off_table, c->off_table, sizeof(off_table));
+	off_count = c->off_count;
+	off_next = 0;
+	if (!off_count) off_now = 0;
+	// A new tick period (-H, -t, -B), or asleep through an off window that
+	// may have changed: start over from whatever tick it is now. The old
+	// next_tick would have every wakeup until then look early.
+	if (display_off || tick_period() != period) {
+		next_tick = 0;
+		flip_next = 0;
+	}
+	__atomic_store_n(&cfg_adopted, c, __ATOMIC_RELEASE);
+}
+
+// Commands for the clock (see control.h):
+//
+// text words - show the words for a few seconds, scrolling if need be
+// countdown when[,hold|blink|up] - a new countdown target (-C)
+static void control_poll() {
+	struct ctl_cmd cmd;
+	while(ctl_pop(&cmd)) {
+		long long target;
+		unsigned char after;
+		if (!strncmp(cmd.text, "text ", 5)) {
+			msg_set(cmd.text + 5);
+		} else if (time_source == TS_COUNTDOWN && !strncmp(cmd.text, "countdown ", 10)
+				&& !countdown_parse(cmd.text + 10, &target, &after)) {
+			countdown_target = leap_from_posix(target);
+			countdown_after = after;
+			// Show it right away, the way the first tick is.
+			next_tick = 0;
+			flip_next = 0;
+		} else {
+			stat_commands_bad++;
+			continue;
+		}
+		stat_commands++;
+	}
+}
+
+// A step of the text message, in place of the time. The message is a
+// layer that covers every digit, so the time under it isn't worked out at
+// all. Messages don't use the chip's decoding, and have a tick schedule of
+// their own, a step apart on the time source's grid. Only the digits that
+// have changed since the last step are sent. Returns 0 if the message is
+// over (or there isn't one, after all), in which case the time is due
+// right away.
+static ALWAYS_INLINE int msg_frame(int src, long long wakeup, uint32_t wake_clock, struct trace_record *rec) {
+	long long step = ts_floor(src, wakeup + FUDGE, MSG_STEP);
+	if (msg_pending) {
+		msg_pending = 0;
+		// Nobody would see it.
+		if (off_now && step >= off_wake_until) {
+			msg_end = 0;
+			comp_clear(LAYER_TEXT);
+			return 0;
+		}
+		msg_start = step;
+		msg_end = step + msg_steps() * MSG_STEP;
+		memset(msg_regs, 0xff, sizeof(msg_regs)); // which is nothing we'd write
+	}
+	if (step >= msg_end) {
+		msg_end = 0;
+		comp_clear(LAYER_TEXT);
+		return 0;
+	}
+	// Sidereal steps are a little short, so round.
+	int pos = (int)((step - msg_start + MSG_STEP / 2) / MSG_STEP);
+	struct frame frame;
+	frame.count = 0;
+	if (flip_decode != 0) {
+		frame_add(&frame, MAX_REG_DEC_MODE, 0);
+		flip_decode = 0;
+	}
+	if (display_off) {
+		// An event woke the display up for it, in an off window.
+		frame_add(&frame, MAX_REG_CONFIG, MAX_REG_CONFIG_S);
+		display_off = 0;
+	}
+	unsigned char segs[LAYER_DIGITS];
+	for(int i = DIGIT_10_HR; i <= DIGIT_MISC; i++) {
+		segs[i] = 0; // the misc digit stays dark
+		if (i != DIGIT_MISC) {
+			int k = (msg_len <= DIGIT_MISC)?i:pos + i - DIGIT_MISC;
+			if (k >= 0 && k < msg_len) segs[i] = msg_glyphs[k];
+		}
+	}
+	comp_set(LAYER_TEXT, PRIO_TEXT, msg_end, msg_mask, segs);
+	comp_update(step);
+	unsigned char decode_mask = 0;
+	for(int i = DIGIT_10_HR; i <= DIGIT_MISC; i++) {
+		unsigned char g = comp_digit(i, 0, &decode_mask);
+		if (g == msg_regs[i]) continue;
+		frame_add(&frame, MAX_REG_MASK_BOTH | i, g);
+		msg_regs[i] = g;
+	}
+	perf_mark(STAGE_TIME);
+	if (frame.count) {
+		finish_tick(rec, step, wakeup, wake_clock, TRACE_TEXT, &frame);
+	} else {
+		trace_tick(rec, step, wakeup, wake_clock, wake_clock, wake_clock, TRACE_TEXT, NULL);
+	}
+	next_tick = ts_next(src, step, MSG_STEP);
+	flip_next = 0;
+	return 1;
+}
+
+// One tick. src is always a constant - see display_loop().
+static ALWAYS_INLINE void update_display(int src) {
+
+	long long wakeup = sim_clock;
+	if (!wakeup) {
+		struct timespec now;
+		if (clock_gettime(tick_clock, &now)) {
+			perror("clock_gettime");
+			exit(1);
+		}
+		wakeup = (long long)now.tv_sec * SECOND_IN_NANOS + now.tv_nsec;
+	}
+	uint32_t wake_clock = trace_clock();
+	perf_start();
+	struct trace_record *rec = trace_begin();
+
+	if (ctl_fd >= 0) control_poll();
+	if (cfg_published != cfg_adopted) config_adopt();
+	if (ev_published != ev_adopted) {
+		// A new events file. Whatever's due since the last tick is still
+		// to come.
+		ev_adopt(leap_to_posix(last_tick?last_tick:wakeup + FUDGE));
+		ev_next = ev_count?leap_from_posix(ev_top()):0;
+		// If we're asleep through an off window, one in it needs waking
+		// up for.
+		if (display_off && ev_next && ev_next < next_tick) {
+			next_tick = ts_next(src, ts_floor(src, ev_next - 1, tick_period()), tick_period());
+		}
+	}
+	if (msg_pending || msg_end) {
+		if (msg_frame(src, wakeup, wake_clock, rec)) return;
+		// Back to the time, whatever tick it is now.
+		next_tick = 0;
+		flip_next = 0;
+	}
 
 #if 0
 	// This can be used to figure out the FUDGE value. You want this line
@@ -209,54 +833,816 @@ static void update_display(union sigval ignore) {
 	fprintf(stderr, "%'8ld\n", error);
 #endif
 
-	// We want to round to the nearest tenth, which means truncating to the nearest hundredth.
-	unsigned int hundredth_val = (unsigned int)(now.tv_nsec / HUNDREDTH_IN_NANOS);
-	unsigned int tenth_val = (hundredth_val + 5) / 10;
-	// if we rounded up, we must adjust the seconds.
-	while (tenth_val >= 10) {
-		now.tv_sec++;
-		tenth_val -= 10;
+	long long period = tick_period();
+	unsigned short flags = 0;
+	// With -F, we're up FLIP_LEAD early rather than FUDGE.
+	unsigned char flipping = flip_next;
+	long long tick = pick_tick(src, flipping?wakeup + FLIP_LEAD - FUDGE:wakeup, period, &flags);
+	if (tick == 0) {
+		trace_tick(rec, next_tick, wakeup, wake_clock, wake_clock, wake_clock, flags, NULL);
+		return;
+	}
+	last_tick = tick;
+	stat_ticks++;
+	if (ev_next && tick >= ev_next) {
+		events_fire(tick);
+		// A message goes up now, not a tick from now.
+		if (msg_pending && msg_frame(src, wakeup, wake_clock, rec)) return;
 	}
+	// Degrading may have just changed the period.
+	period = tick_period();
+	unsigned char show_tenth = tenth_enable && !degraded && !hhmm;
+	if (degraded) flags |= TRACE_DEGRADED;
+	struct frame frame;
+	frame.count = 0;
 
-	struct tm lt;
-	localtime_r(&now.tv_sec, &lt);
+	// The off windows go by when the frame would land, not by the tick,
+	// which can come before the end of the window.
+	if (off_count && wakeup + FUDGE >= off_next) {
+		off_now = off_eval(leap_to_posix(wakeup + FUDGE), &off_next);
+		off_next = leap_from_posix(off_next);
+	}
+	if (off_now && tick >= off_wake_until) {
+		// Shut the chip down, then sleep until the first tick after the
+		// window ends - or an event in it, which may want the display.
+		if (!display_off) {
+			display_off = 1;
+			flags |= TRACE_OFF;
+			frame_add(&frame, MAX_REG_CONFIG, 0);
+			perf_mark(STAGE_TIME);
+			finish_tick(rec, tick, wakeup, wake_clock, flags, &frame);
+		} else {
+			trace_tick(rec, tick, wakeup, wake_clock, wake_clock, wake_clock, flags | TRACE_OFF, NULL);
+		}
+		next_tick = ts_next(src, ts_floor(src, ((ev_next && ev_next < off_next)?ev_next:off_next) - 1, period), period);
+		flip_next = 0;
+		return;
+	}
+	perf_mark(STAGE_TIME);
+
+	// From here on, we display the tick, not whatever time it happens to be.
+	struct ts_digits d;
+	ts_digits(src, tick, &d);
+	perf_mark(STAGE_CALENDAR);
 
-	unsigned char h = lt.tm_hour;
+	// There's no such thing as PM in sidereal time, or for a countdown.
+	unsigned char twelve = ampm && !TS_IS_SIDEREAL(src) && src != TS_COUNTDOWN;
+	unsigned char h = d.hour;
 	unsigned char pm = 0;
-	if (ampm) {
+	if (twelve) {
 		if (h == 0) { h = 12; }
 		else if (h == 12) { pm = 1; }
 		else if (h > 12) { h -= 12; pm = 1; }
 	}
 
 	unsigned char decode_mask = (unsigned char)(~_BV(DIGIT_MISC)); // All decode except the misc digit.
-	if (ampm && h < 10) {
+	if ((twelve || src == TS_COUNTDOWN) && h < 10) {
 		decode_mask &= ~_BV(DIGIT_10_HR); // for the 12 hour display, blank leading 0 for hour
 	}
-	if (!tenth_enable) {
+	if (!show_tenth) {
 		decode_mask &= ~_BV(DIGIT_100_MSEC); // turn off the tenth digit decode. We'll write a 0.
 	}
-	write_reg(MAX_REG_DEC_MODE, decode_mask);
+	if (hhmm) {
+		decode_mask &= ~(_BV(DIGIT_10_SEC) | _BV(DIGIT_1_SEC)); // and the same for the seconds.
+	}
+	unsigned char digits[DIGIT_MISC];
+	digits[DIGIT_10_HR] = h / 10;
+	digits[DIGIT_1_HR] = h % 10;
+	digits[DIGIT_10_MIN] = d.min / 10;
+	digits[DIGIT_1_MIN] = d.min % 10;
+	digits[DIGIT_10_SEC] = hhmm?0:d.sec / 10;
+	digits[DIGIT_1_SEC] = hhmm?0:(d.sec % 10) | (show_tenth?MASK_DP:0);
+	digits[DIGIT_100_MSEC] = show_tenth?d.tenth:0;
 
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_10_HR, h / 10);
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_1_HR, h % 10);
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_10_MIN, lt.tm_min / 10);
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_1_MIN, lt.tm_min % 10);
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_10_SEC, lt.tm_sec / 10);
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_1_SEC, (lt.tm_sec % 10) | (tenth_enable?MASK_DP:0));
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_100_MSEC, tenth_enable?tenth_val:0);
+	if (src == TS_ZONES) {
+		// Which zone, on the otherwise unused segments. It's only a
+		// change once every few seconds.
+		static const unsigned char zone_mask[LAYER_DIGITS] = { [DIGIT_MISC] = MASK_G | MASK_DP };
+		unsigned char zone_segs[LAYER_DIGITS] = { [DIGIT_MISC] = ((d.zone & 1)?MASK_G:0) | ((d.zone & 2)?MASK_DP:0) };
+		comp_set(LAYER_ZONE, PRIO_ZONE, 0, zone_mask, zone_segs);
+	}
+	unsigned char ntp_now = ntp_enable?ntp_state:NTP_SYNCED;
+	if (ntp_now != ntp_shown) {
+		// Trouble is on the misc digit's G (not synchronized) or decimal
+		// point (too much error), over the zone, if there is one. In sync,
+		// there's nothing to see.
+		static const unsigned char ntp_mask[LAYER_DIGITS] = { [DIGIT_MISC] = MASK_G | MASK_DP };
+		unsigned char ntp_segs[LAYER_DIGITS] = { [DIGIT_MISC] = (ntp_now == NTP_UNSYNC)?MASK_G:MASK_DP };
+		ntp_shown = ntp_now;
+		if (ntp_shown == NTP_SYNCED) comp_clear(LAYER_NTP);
+		else comp_set(LAYER_NTP, PRIO_NTP, 0, ntp_mask, ntp_segs);
+	}
+	// Anything over the time. Usually there's nothing.
+	if (comp_update(tick)) {
+		for(int i = DIGIT_10_HR; i < DIGIT_MISC; i++) digits[i] = comp_digit(i, digits[i], &decode_mask);
+	}
 
-	unsigned char misc_digit = 0;
-	if (colon && ((!colon_blink) || (now.tv_sec % 2 == 0))) {
-		misc_digit |= MASK_COLON_HM | MASK_COLON_MS;
+	// Double buffering (-F). With the blink on, the chip shows plane 0 for
+	// half a second after the blink timer is reset, then plane 1. Both
+	// planes have the same digits, except that FLIP_LEAD before a second
+	// boundary (when plane 0 is hidden) the next second's go into plane 0.
+	// At the boundary, a config write resets the timer, which shows them,
+	// and the same digits go into plane 1 behind them. That only works for
+	// ticks a second apart that are on time, and the decode mode is for
+	// both planes, so otherwise it's the whole frame to both planes at the
+	// boundary, as usual.
+	//
+	// An event's blink uses the planes too. The digits go in plane 0 only,
+	// plane 1 is blank, and the chip's blink timer switches between them.
+	// The colons can't blink by themselves meanwhile.
+	unsigned char blink = blink_until && tick < blink_until;
+	unsigned char hw_colons = colon && colon_blink && hw_blink && !blink;
+	unsigned char flip_usable = flip_enable && !(colon && colon_blink && hw_blink);
+	unsigned char flip = flipping && flip_usable && period == SECOND_IN_NANOS && decode_mask == flip_decode && !display_off
+		&& !blink && !blinking && !(flags & (TRACE_FIRST | TRACE_LATE | TRACE_SKIPPED | TRACE_CATCHUP));
+	unsigned char plane = (flip || blink)?MAX_REG_MASK_P0:MAX_REG_MASK_BOTH;
+	if (!flip) frame_add(&frame, MAX_REG_DEC_MODE, decode_mask);
+	flip_decode = decode_mask;
+	// One intensity write at most. An event's level (or a new config's)
+	// goes over the schedule's, until the schedule next changes.
+	int level = -1;
+	if (bright_count && tick >= bright_next) {
+		level = bright_eval(leap_to_posix(tick), &bright_next);
+		bright_next = leap_from_posix(bright_next);
+	}
+	if (bright_pending >= 0) {
+		level = bright_pending;
+		bright_pending = -1;
 	}
-	if (ampm) {
+	if (level >= 0 && level != bright_current) {
+		frame_add(&frame, MAX_REG_INTENSITY, level);
+		bright_current = level;
+	}
+
+	for(int i = DIGIT_10_HR; i < DIGIT_MISC; i++) frame_add(&frame, plane | i, digits[i]);
+
+	unsigned char misc_digit = 0;
+	unsigned char colons = hhmm?MASK_COLON_HM:(MASK_COLON_HM | MASK_COLON_MS);
+	if (twelve) {
 		misc_digit |= (pm?MASK_PM:MASK_AM);
 	}
-	write_reg(MAX_REG_MASK_BOTH | DIGIT_MISC, misc_digit);
+	if (hw_colons) {
+		// Plane 0 has the colons and plane 1 doesn't, and the chip flips
+		// between them once a second on its own. Resetting the blink
+		// timer on a minute boundary (an even second) keeps it in step
+		// with us - but only if we're on time, or we'd just be dragging
+		// it out of step. For sidereal time, its seconds are a little
+		// long, but not so you'd notice in a minute.
+		frame_add(&frame, MAX_REG_MASK_P0 | DIGIT_MISC, comp_digit(DIGIT_MISC, misc_digit | colons, &decode_mask));
+		frame_add(&frame, MAX_REG_MASK_P1 | DIGIT_MISC, comp_digit(DIGIT_MISC, misc_digit, &decode_mask));
+		unsigned char config = MAX_REG_CONFIG_S | MAX_REG_CONFIG_E;
+		if (!(flags & (TRACE_FIRST | TRACE_LATE)) && d.tenth == 0 && d.sec % (blink_synced?60:2) == 0) {
+			config |= MAX_REG_CONFIG_T;
+			blink_synced = 1;
+		}
+		frame_add(&frame, MAX_REG_CONFIG, config);
+	} else {
+		if (colon && ((!colon_blink) || (d.sec % 2 == 0))) {
+			misc_digit |= colons;
+		}
+		frame_add(&frame, plane | DIGIT_MISC, comp_digit(DIGIT_MISC, misc_digit, &decode_mask));
+	}
+	unsigned char config_done = hw_colons;
+	if (blink || blinking) {
+		// Starting or stopping an event's blink. The blanks for plane 1
+		// come after the frame.
+		if (!blink && !config_done) frame_add(&frame, MAX_REG_CONFIG, flip_usable?MAX_REG_CONFIG_FLIP:MAX_REG_CONFIG_S);
+		if (!blink) blink_until = 0;
+		config_done = 1;
+	}
+	if (display_off) {
+		// Back from an off window. With the hardware blink, the config
+		// register has already been taken care of. Not R - that would
+		// clear the digits we just wrote.
+		if (!config_done) frame_add(&frame, MAX_REG_CONFIG, flip_usable?MAX_REG_CONFIG_FLIP:MAX_REG_CONFIG_S);
+		config_done = 1;
+		display_off = 0;
+	}
+	if (src == TS_COUNTDOWN && countdown_blinking) {
+		// A new countdown. Stop blinking the last one.
+		if (!config_done) frame_add(&frame, MAX_REG_CONFIG, flip_usable?MAX_REG_CONFIG_FLIP:MAX_REG_CONFIG_S);
+		config_done = 1;
+		countdown_blinking = 0;
+	}
+
+	long long landed;
+	if (flip) {
+		// The staged digits get a trace record of their own, ahead of the
+		// flip's, and sending them and the wait are stages of their own.
+		perf_mark(STAGE_ENCODE);
+		uint32_t start_clock = trace_clock();
+		commit_frame(&frame);
+		trace_tick(rec, tick, wakeup, wake_clock, start_clock, trace_clock(), flags | TRACE_STAGED, &frame);
+		perf_mark(STAGE_STAGED);
+		wakeup = wait_for_tick(tick, &wake_clock);
+		perf_mark(STAGE_WAIT);
+		rec = trace_begin();
+		struct frame show;
+		show.count = 0;
+		frame_add(&show, MAX_REG_CONFIG, MAX_REG_CONFIG_FLIP);
+		for(int i = 0; i < frame.count; i++) {
+			if (frame.regs[i][0] & MAX_REG_MASK_P0) {
+				frame_add(&show, (frame.regs[i][0] & ~MAX_REG_MASK_BOTH) | MAX_REG_MASK_P1, frame.regs[i][1]);
+			}
+		}
+		landed = finish_tick(rec, tick, wakeup, wake_clock, flags | TRACE_FLIP, &show);
+	} else {
+		if (flipping) {
+			perf_mark(STAGE_ENCODE);
+			wakeup = wait_for_tick(tick, &wake_clock);
+			perf_mark(STAGE_WAIT);
+		}
+		// Reset the blink timer, so the next tick can be flipped in.
+		if (flip_usable && period == SECOND_IN_NANOS && !config_done) frame_add(&frame, MAX_REG_CONFIG, MAX_REG_CONFIG_FLIP);
+		landed = finish_tick(rec, tick, wakeup, wake_clock, flags, &frame);
+	}
+
+	if (blink && (!blinking || decode_mask != blink_decode)) {
+		// Blank plane 1 (what blank is depends on the decoding), and
+		// start the blink timer. The decoding can change as it goes.
+		struct frame blank;
+		blank.count = 0;
+		for(int i = DIGIT_10_HR; i <= DIGIT_MISC; i++) {
+			frame_add(&blank, MAX_REG_MASK_P1 | i, (decode_mask & _BV(i))?0x0f:0);
+		}
+		if (!blinking) frame_add(&blank, MAX_REG_CONFIG, MAX_REG_CONFIG_S | MAX_REG_CONFIG_E | MAX_REG_CONFIG_B | MAX_REG_CONFIG_T);
+		commit_frame(&blank);
+		blink_decode = decode_mask;
+	}
+	blinking = blink;
+
+	if (src == TS_COUNTDOWN && tick == countdown_target) {
+		// Zero. How close did we get? (Not if it was over before we
+		// started, or the tick was missed.)
+		if (!(flags & (TRACE_FIRST | TRACE_CATCHUP | TRACE_SKIPPED))) {
+			long long error = landed - tick;
+			stat_countdown_error = error;
+			if (llabs(error) > llabs(stat_countdown_error_max)) stat_countdown_error_max = error;
+			stat_countdown_zeros++;
+		}
+		if (countdown_after == CD_BLINK) {
+			// Now that the zeros are up, blank plane 1 behind them and
+			// start the blink timer. There's nothing more to do until
+			// there's another countdown.
+			struct frame blank;
+			blank.count = 0;
+			for(int i = DIGIT_10_HR; i <= DIGIT_100_MSEC; i++) {
+				frame_add(&blank, MAX_REG_MASK_P1 | i, (decode_mask & _BV(i))?0x0f:0);
+			}
+			frame_add(&blank, MAX_REG_MASK_P1 | DIGIT_MISC, 0);
+			frame_add(&blank, MAX_REG_CONFIG, MAX_REG_CONFIG_S | MAX_REG_CONFIG_E | MAX_REG_CONFIG_B | MAX_REG_CONFIG_T);
+			commit_frame(&blank);
+			countdown_blinking = 1;
+		}
+	}
+
+	// Set us up the bomb. If we're behind, this goes off right away.
+	next_tick = ts_next(src, tick, period);
+	flip_next = flip_usable && tick_period() == SECOND_IN_NANOS;
+}
+
+// One tick, for whatever the time source is: the first update, before the
+// display thread exists, and every tick of a simulation.
+static void update_any() {
+	switch(time_source) {
+		case TS_CIVIL: update_display(TS_CIVIL); break;
+		case TS_UTC: update_display(TS_UTC); break;
+		case TS_SIDEREAL: update_display(TS_SIDEREAL); break;
+		case TS_SIDEREAL06: update_display(TS_SIDEREAL06); break;
+		case TS_COUNTDOWN: update_display(TS_COUNTDOWN); break;
+		case TS_ZONES: update_display(TS_ZONES); break;
+	}
+}
+
+// The countdown (-C) can be given a new target through the control socket.
+// Once it's at zero and staying there, there's no tick to wake up for, so
+// it waits for the control thread's kick instead. SIGRTMIN is blocked
+// while it looks, so a kick that comes before it gets to sigsuspend()
+// isn't lost.
+static void countdown_wait() {
+	sigset_t kick, waiting;
+	sigemptyset(&kick);
+	sigaddset(&kick, SIGRTMIN);
+	pthread_sigmask(SIG_BLOCK, &kick, &waiting);
+	while(1) {
+		if (ctl_fd >= 0) control_poll();
+		if (next_tick == 0) update_display(TS_COUNTDOWN);
+		if (msg_pending || msg_end || countdown_after == CD_UP || last_tick < countdown_target) break;
+		display_due = 0;
+		sigsuspend(&waiting);
+	}
+	pthread_sigmask(SIG_UNBLOCK, &kick, NULL);
+}
+
+static const char *policy_name(int policy) {
+	switch(policy) {
+		case SCHED_RR: return "rr";
+		case SCHED_FIFO: return "fifo";
+		case SCHED_DEADLINE: return "deadline";
+		default: return "other";
+	}
+}
+
+// The period of the SCHED_DEADLINE reservation the display thread has,
+// or 0 if it doesn't have one. Only the display thread touches it.
+static long long dl_period = 0;
+
+// Move the display thread to SCHED_DEADLINE. The period is the tick, the
+// runtime is what we've seen the handler take (with a margin), and the
+// deadline is when the frame is due, relative to when we wake up - unless
+// the runtime is longer than that, in which case it can't be. Neither can
+// be longer than the period.
+static void set_deadline(unsigned long handler_usec, long long period) {
+	uint64_t runtime = (uint64_t)handler_usec * 1000 * DL_RUNTIME_MARGIN;
+	if (runtime < DL_RUNTIME_MIN) runtime = DL_RUNTIME_MIN;
+	if (runtime > (uint64_t)period) runtime = (uint64_t)period;
+	uint64_t deadline = FUDGE + LATE_SLOP;
+	if (deadline < runtime) deadline = runtime;
+	if (deadline > (uint64_t)period) deadline = (uint64_t)period;
+	struct dl_sched_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_runtime = runtime;
+	attr.sched_deadline = deadline;
+	attr.sched_period = (uint64_t)period;
+	if (syscall(SYS_sched_setattr, 0, &attr, 0)) {
+		// EBUSY is admission control saying no. EPERM usually means the
+		// thread's CPU affinity is narrower than its root domain.
+		snprintf(sched_report, sizeof(sched_report), "%s %d (deadline %llu/%llu/%llu refused: %s)",
+			policy_name(rt_policy), rt_priority, (unsigned long long)runtime, (unsigned long long)deadline,
+			(unsigned long long)attr.sched_period, strerror(errno));
+	} else {
+		dl_period = period;
+		snprintf(sched_report, sizeof(sched_report), "deadline %llu/%llu/%llu",
+			(unsigned long long)runtime, (unsigned long long)deadline, (unsigned long long)attr.sched_period);
+	}
+	fprintf(stderr, "display thread: %s\n", sched_report);
+}
+
+// The display thread's loop, for time source src. This gets built once
+// for each source with src a constant, so that the whole tick is
+// specialized and inlined for it.
+static ALWAYS_INLINE void display_loop(int src, unsigned char calibrating) {
+	long long kicked = 0;
+	while(1) {
+		if (src == TS_COUNTDOWN) countdown_wait();
+		// We want to individually schedule each one rather than use an interval,
+		// because it gives us better control in the face of variable response latency.
+		// We will simply specify exactly when we desire to be woken up every time.
+		// We want the alarm to go off a little early (FUDGE).
+		long long wake = next_tick - (flip_next?FLIP_LEAD:FUDGE);
+		display_due = next_tick;
+		struct timespec wake_spec;
+		wake_spec.tv_sec = (time_t)(wake / SECOND_IN_NANOS);
+		wake_spec.tv_nsec = (long)(wake % SECOND_IN_NANOS);
+		int err = clock_nanosleep(tick_clock, TIMER_ABSTIME, &wake_spec, NULL);
+		if (err != 0 && err != EINTR) {
+			errno = err;
+			perror("clock_nanosleep");
+			exit(1);
+		}
+		stat_wakeups++;
+		woke_kicked = (err == EINTR);
+		if (woke_kicked) stat_kicks++;
+		update_display(src);
+		// If the housekeeping is due, do it now while the CPU is awake
+		// rather than have it wake up again for it later.
+		long long due = housekeeping_due;
+		if (due != 0 && due != kicked && last_tick >= due) {
+			kicked = due;
+			pthread_kill(main_tid, SIGUSR2);
+		}
+		if (calibrating && stat_ticks >= DL_CALIBRATION_TICKS) {
+			calibrating = 0;
+			set_deadline(stat_handler_max, tick_period());
+		}
+		// A new config, or degrading, can change the tick. The reservation
+		// has to follow it, or we'd be asking for the wrong thing.
+		if (dl_period != 0 && tick_period() != dl_period) set_deadline(stat_handler_max, tick_period());
+	}
+}
+
+static void __attribute__((noinline)) display_loop_civil(unsigned char calibrating) {
+	display_loop(TS_CIVIL, calibrating);
+}
+
+static void __attribute__((noinline)) display_loop_utc(unsigned char calibrating) {
+	display_loop(TS_UTC, calibrating);
+}
+
+static void __attribute__((noinline)) display_loop_sidereal(unsigned char calibrating) {
+	display_loop(TS_SIDEREAL, calibrating);
+}
+
+static void __attribute__((noinline)) display_loop_sidereal06(unsigned char calibrating) {
+	display_loop(TS_SIDEREAL06, calibrating);
+}
+
+static void __attribute__((noinline)) display_loop_countdown(unsigned char calibrating) {
+	display_loop(TS_COUNTDOWN, calibrating);
+}
 
-	// Set us up the bomb.
-	schedule_timer();
+static void __attribute__((noinline)) display_loop_zones(unsigned char calibrating) {
+	display_loop(TS_ZONES, calibrating);
+}
+
+// The stopwatch (-W) has a loop of its own. There's no calendar and no
+// schedule, and it runs on CLOCK_MONOTONIC, not the tick clock. It sleeps
+// until the shown time next changes (or, stopped, until a command comes in),
+// works out the digits, and writes only the registers that changed - at 100
+// Hz that's usually just the hundredths, and the tens of them.
+// The control thread kicks us with SIGRTMIN. It stays blocked here, so one
+// that comes in while we're awake is still pending when we go to sleep.
+static void stopwatch_wait(long long wake) {
+	display_due = wake;
+	long long left = wake?wake - ctl_now():3600LL * SECOND_IN_NANOS;
+	if (left <= 0) return;
+	struct timespec left_spec;
+	left_spec.tv_sec = (time_t)(left / SECOND_IN_NANOS);
+	left_spec.tv_nsec = (long)(left % SECOND_IN_NANOS);
+	sigset_t kick;
+	sigemptyset(&kick);
+	sigaddset(&kick, SIGRTMIN);
+	if (sigtimedwait(&kick, NULL, &left_spec) < 0 && errno != EAGAIN && errno != EINTR) {
+		perror("sigtimedwait(stopwatch)");
+		exit(1);
+	}
+}
+
+static void stopwatch_loop() {
+	struct sw_state sw;
+	memset(&sw, 0, sizeof(sw));
+	unsigned char regs[8]; // what the digits have now
+	memset(regs, 0xff, sizeof(regs)); // which is nothing we'd write
+	unsigned char first = 1;
+	long long next = 0; // the hundredth we last slept until, or 0
+	while(1) {
+		long long now = ctl_now();
+		uint32_t wake_clock = trace_clock();
+		perf_start();
+		stat_wakeups++;
+		// Woken before then (or at all, stopped), it was a command.
+		unsigned short flags = (!first && (!next || now < next - FUDGE))?TRACE_KICK:0;
+		long long target = (next && !flags)?next:now + FUDGE;
+		// Commands count from when they came in, not from now.
+		long long pending = 0;
+		struct ctl_cmd cmd;
+		while(ctl_pop(&cmd)) {
+			if (sw_command(&sw, cmd.text, cmd.when)) {
+				stat_commands_bad++;
+				continue;
+			}
+			stat_commands++;
+			if (!pending) pending = cmd.when;
+		}
+
+		// What will be showing by the time the frame lands.
+		int lap;
+		long long t = sw_shown(&sw, now + FUDGE, &lap);
+		unsigned char digits[8], hm, ms;
+		sw_digits(t, lap, sw.laps, digits, &hm, &ms);
+		digits[(t < SW_HOUR_IN_NANOS)?DIGIT_1_MIN:DIGIT_1_SEC] |= MASK_DP;
+		digits[DIGIT_MISC] = (colon?((hm?MASK_COLON_HM:0) | (ms?MASK_COLON_MS:0)):0);
+		perf_mark(STAGE_TIME);
+
+		struct frame frame;
+		frame.count = 0;
+		if (first) {
+			// All decode except the misc digit, for good.
+			frame_add(&frame, MAX_REG_DEC_MODE, (unsigned char)(~_BV(DIGIT_MISC)));
+			flags |= TRACE_FIRST;
+			first = 0;
+		}
+		for(int i = 0; i < 8; i++) {
+			if (digits[i] == regs[i]) continue;
+			frame_add(&frame, MAX_REG_MASK_BOTH | i, digits[i]);
+			regs[i] = digits[i];
+		}
+		if (frame.count) {
+			finish_tick(trace_begin(), target, now, wake_clock, flags, &frame);
+			if (stat_ticks++ == 0) notify_send("READY=1");
+		}
+		if (pending) {
+			unsigned long usec = (unsigned long)((ctl_now() - pending) / 1000);
+			stat_command_latency += usec;
+			if (usec > stat_command_latency_max) stat_command_latency_max = usec;
+			if (usec * 1000 > SW_HUNDREDTH_IN_NANOS) stat_command_over++;
+		}
+
+		next = sw_next(&sw, now + FUDGE);
+		stopwatch_wait(next?next - FUDGE:0);
+	}
+}
+
+// For the watchdog: whether the display thread is keeping up. It has to be
+// on time for its next wakeup, give or take, and not have missed too many
+// ticks since we last looked. The housekeeping calls this.
+static int display_healthy() {
+	static unsigned long last_misses = 0;
+	unsigned long misses = stat_late + stat_skipped;
+	unsigned long missed = misses - last_misses;
+	last_misses = misses;
+	long long due = display_due;
+	if (due != 0) {
+		struct timespec now;
+		clock_gettime(stopwatch?CLOCK_MONOTONIC:tick_clock, &now);
+		if ((long long)now.tv_sec * SECOND_IN_NANOS + now.tv_nsec > due + WATCHDOG_GRACE) return 0;
+	}
+	return missed < miss_threshold;
+}
+
+// With -f, watch the file (see config.h). A new one is taken up at the
+// next tick, but the display thread could be asleep through an off window
+// that the new one doesn't have.
+static void config_kick() {
+	pthread_kill(display_tid, SIGRTMIN);
+}
+
+static void *config_thread(void *ignore) {
+	cfg_watch(cfg_file, config_kick);
+	return NULL;
+}
+
+static void *display_thread(void *ignore) {
+	if (cpu_pin >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu_pin, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+			fprintf(stderr, "Can't pin the display thread to CPU %d\n", cpu_pin);
+		}
+	}
+	snprintf(sched_report, sizeof(sched_report), "%s %d", policy_name(rt_policy), rt_priority);
+	unsigned char calibrating = deadline_enable;
+	// Every tick we show is a visible change, so the display thread wants
+	// no slack at all. (The kernel doesn't give real time threads any
+	// anyway, but say so.)
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+	if (perf_enable && !perf_open()) {
+		fprintf(stderr, "No performance counters could be opened\n");
+	}
+	if (stopwatch) {
+		stopwatch_loop();
+		return NULL;
+	}
+	// Otherwise, the control thread's kick interrupts our sleep, so that a
+	// message goes up right away.
+	sigset_t kick;
+	sigemptyset(&kick);
+	sigaddset(&kick, SIGRTMIN);
+	pthread_sigmask(SIG_UNBLOCK, &kick, NULL);
+	// Pick the copy of the loop built for our time source.
+	switch(time_source) {
+		case TS_CIVIL: display_loop_civil(calibrating); break;
+		case TS_UTC: display_loop_utc(calibrating); break;
+		case TS_SIDEREAL: display_loop_sidereal(calibrating); break;
+		case TS_SIDEREAL06: display_loop_sidereal06(calibrating); break;
+		case TS_COUNTDOWN: display_loop_countdown(calibrating); break;
+		case TS_ZONES: display_loop_zones(calibrating); break;
+	}
+	return NULL;
+}
+
+// The simulation (-V) runs the display code on a virtual clock that jumps
+// straight to each wakeup, and prints every frame instead of sending it,
+// along with what the display would then show. Frames go out a line each:
+//
+// 2017-03-12 03:00:00.000 -0700  3:00:00.0 AM  01:7f 60:00 61:03 ...
+//
+// The time is when the frame lands, and the registers are as in SPI_Trace.c.
+// Run the same thing again after a change and diff the two to see what it
+// did to the display. Set TZ to try other time zones.
+
+// What the chip has been told so far, and when its blink timer was reset
+static unsigned char sim_regs[8];
+static unsigned char sim_digits[2][8]; // plane 0 and plane 1
+static long long sim_blink_reset = 0;
+static unsigned long sim_frames = 0;
+
+// What the display shows at the instant t, like " 3:00:00.0 AM".
+static void sim_render(long long t, char *out) {
+	// The MAX6951's code B font
+	static const char font[] = "0123456789-EHLP ";
+	if (!(sim_regs[MAX_REG_CONFIG] & MAX_REG_CONFIG_S)) {
+		strcpy(out, "(off)");
+		return;
+	}
+	// With the blink on, plane 0 for the first half of each period after
+	// the timer was reset, and plane 1 for the second.
+	int plane = 0;
+	if (sim_regs[MAX_REG_CONFIG] & MAX_REG_CONFIG_E) {
+		long long half = (sim_regs[MAX_REG_CONFIG] & MAX_REG_CONFIG_B)?SECOND_IN_NANOS / 2:SECOND_IN_NANOS;
+		plane = (int)(((t - sim_blink_reset) / half) % 2);
+	}
+	const unsigned char *digits = sim_digits[plane];
+	unsigned char misc = digits[DIGIT_MISC];
+	for(int i = DIGIT_10_HR; i <= DIGIT_100_MSEC; i++) {
+		unsigned char v = digits[i];
+		if (sim_regs[MAX_REG_DEC_MODE] & _BV(i)) {
+			*out++ = font[v & 0xf];
+		} else {
+			// Whatever letter it looks like
+			char c = (v & ~MASK_DP)?'?':' ';
+			for(int j = ' '; j < 128 && c == '?'; j++) {
+				if (glyph_font[j] == (v & ~MASK_DP)) c = (char)j;
+			}
+			*out++ = c;
+		}
+		if (v & MASK_DP) *out++ = '.';
+		if (i == DIGIT_1_HR) *out++ = (misc & MASK_COLON_HM)?':':' ';
+		if (i == DIGIT_1_MIN) *out++ = (misc & MASK_COLON_MS)?':':' ';
+	}
+	strcpy(out, (misc & MASK_AM)?" AM":(misc & MASK_PM)?" PM":"   ");
+}
+
+static void sim_frame(const struct frame *f) {
+	static const char hex[] = "0123456789abcdef";
+	// The date only changes once a second, so it's kept.
+	static time_t date_sec = -1;
+	static char date[32], zone[16];
+	for(int i = 0; i < f->count; i++) {
+		unsigned char reg = f->regs[i][0], data = f->regs[i][1];
+		if (reg & MAX_REG_MASK_P0) sim_digits[0][reg & 7] = data;
+		if (reg & MAX_REG_MASK_P1) sim_digits[1][reg & 7] = data;
+		if (reg < sizeof(sim_regs)) sim_regs[reg] = data;
+		if (reg == MAX_REG_CONFIG && (data & MAX_REG_CONFIG_T)) sim_blink_reset = sim_clock + FUDGE;
+	}
+	long long t = leap_to_posix(sim_clock + FUDGE);
+	time_t sec = (time_t)(t / SECOND_IN_NANOS);
+	if (sec != date_sec) {
+		struct tm lt;
+		localtime_r(&sec, &lt);
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &lt);
+		strftime(zone, sizeof(zone), "%z", &lt);
+		date_sec = sec;
+	}
+	char line[256], shown[32];
+	sim_render(sim_clock + FUDGE, shown);
+	int len = snprintf(line, sizeof(line), "%s.%03d %s  %s ", date, (int)((t % SECOND_IN_NANOS) / (SECOND_IN_NANOS / 1000)),
+		zone, shown);
+	for(int i = 0; i < f->count; i++) {
+		char *p = line + len;
+		p[0] = ' ';
+		p[1] = hex[f->regs[i][0] >> 4];
+		p[2] = hex[f->regs[i][0] & 0xf];
+		p[3] = ':';
+		p[4] = hex[f->regs[i][1] >> 4];
+		p[5] = hex[f->regs[i][1] & 0xf];
+		len += 6;
+	}
+	line[len++] = '\n';
+	fwrite(line, 1, len, stdout);
+	sim_frames++;
+}
+
+// Run from the instant from until the instant until, waking up exactly on
+// time for every tick.
+static void simulate(long long from, long long until) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long long leap_due = from + MINUTE_IN_NANOS;
+	update_any();
+	while(next_tick < until) {
+		// A countdown that's over stays that way.
+		if (time_source == TS_COUNTDOWN && countdown_after != CD_UP && last_tick >= countdown_target) break;
+		// If it went back to sleep without a tick, time still moves on.
+		long long wake = next_tick - (flip_next?FLIP_LEAD:FUDGE);
+		sim_clock = (wake > sim_clock)?wake:sim_clock + LATE_SLOP;
+		// What the housekeeping would do, from the file.
+		if (leap_mode && sim_clock >= leap_due) {
+			leap_refresh(leap_to_posix(sim_clock), 0);
+			leap_due += MINUTE_IN_NANOS;
+		}
+		update_any();
+	}
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double took = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double hours = (until - from) / (3600.0 * SECOND_IN_NANOS);
+	fprintf(stderr, "%lu frames, %.1f hours in %.3f s (%.0f simulated hours a second)\n", sim_frames, hours, took,
+		took > 0?hours / took:0);
+}
+
+// How NTP is doing (-n). Not on a tick: this is for the housekeeping, and
+// the display thread gets the answer from ntp_state.
+static void ntp_poll() {
+	struct timex tx;
+	memset(&tx, 0, sizeof(tx));
+	int state = adjtimex(&tx);
+	unsigned char s = NTP_SYNCED;
+	if (state < 0 || state == TIME_ERROR || (tx.status & STA_UNSYNC)) s = NTP_UNSYNC;
+	else if (tx.esterror > ntp_threshold) s = NTP_ERROR;
+	ntp_esterror = tx.esterror;
+	ntp_maxerror = tx.maxerror;
+	if (s != ntp_state) {
+		ntp_state = s;
+		stat_ntp_changes++;
+	}
+}
+
+static time_t start_time; // CLOCK_MONOTONIC
+static const char *stats_file = STATS_FILE;
+
+static void write_stats() {
+	// Write to the side and rename, so readers never see half a file.
+	char tmp_file[64];
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", stats_file);
+	FILE *f = fopen(tmp_file, "w");
+	if (f == NULL) {
+		perror(tmp_file);
+		return;
+	}
+	static const char *policy_names[] = { "late", "skip", "degrade" };
+	if (stopwatch) fprintf(f, "source stopwatch\n");
+	else fprintf(f, "source %s%s\n", ts_names[time_source], apparent?" apparent":"");
+	fprintf(f, "policy %s\n", policy_names[miss_policy]);
+	if (leap_mode) {
+		static const char *leap_names[] = { "none", "tai", "smear" };
+		const struct leap_info *li = leap_now;
+		fprintf(f, "leap %s\n", leap_names[leap_mode]);
+		fprintf(f, "tai_offset %lld\n", li->offset / SECOND_IN_NANOS);
+		if (li->at) fprintf(f, "leap_next %lld %+d\n", li->at / SECOND_IN_NANOS, li->delta);
+	}
+	fprintf(f, "ticks %lu\n", stat_ticks);
+	fprintf(f, "late %lu\n", stat_late);
+	fprintf(f, "skipped %lu\n", stat_skipped);
+	fprintf(f, "early %lu\n", stat_early);
+	fprintf(f, "kicks %lu\n", stat_kicks);
+	fprintf(f, "degrades %lu\n", stat_degrades);
+	fprintf(f, "degraded %u\n", degraded);
+	fprintf(f, "wakeups %lu\n", stat_wakeups);
+	struct timespec uptime;
+	if (clock_gettime(CLOCK_MONOTONIC, &uptime)) uptime.tv_sec = start_time;
+	if (uptime.tv_sec > start_time) {
+		fprintf(f, "wakeups_per_hour %.1f\n", stat_wakeups * 3600.0 / (uptime.tv_sec - start_time));
+	}
+	fprintf(f, "housekeeping %lu\n", stat_housekeeping);
+	fprintf(f, "housekeeping_coalesced %lu\n", stat_coalesced);
+	if (uptime.tv_sec > start_time) {
+		// Display wakeups, plus the housekeeping ones that didn't coincide.
+		fprintf(f, "wakeups_per_second %.3f\n", (stat_wakeups + stat_housekeeping - stat_coalesced) / (double)(uptime.tv_sec - start_time));
+	}
+	fprintf(f, "handler_max_us %lu\n", stat_handler_max);
+	if (stat_frame_overflow) fprintf(f, "frame_overflow %lu\n", stat_frame_overflow);
+	if (stat_spi0_timeouts) fprintf(f, "spi0_timeouts %lu\n", stat_spi0_timeouts);
+	if (notify_watchdog) {
+		fprintf(f, "watchdog_usec %lld\n", notify_watchdog);
+		fprintf(f, "watchdog_fed %lu\n", stat_watchdog);
+		fprintf(f, "watchdog_withheld %lu\n", stat_watchdog_withheld);
+	}
+	if (ctl_fd >= 0) {
+		fprintf(f, "commands %lu\n", stat_commands);
+		fprintf(f, "commands_bad %lu\n", stat_commands_bad);
+		fprintf(f, "commands_dropped %lu\n", ctl_dropped);
+	}
+	if (ntp_enable) {
+		static const char *ntp_names[] = { "synced", "unsynchronized", "error" };
+		fprintf(f, "ntp %s\n", ntp_names[ntp_state]);
+		fprintf(f, "ntp_esterror_us %ld\n", ntp_esterror);
+		fprintf(f, "ntp_maxerror_us %ld\n", ntp_maxerror);
+		fprintf(f, "ntp_changes %lu\n", stat_ntp_changes);
+	}
+	if (ev_file) {
+		fprintf(f, "events %d\n", ev_count);
+		fprintf(f, "events_done %lu\n", stat_events);
+		if (ev_count) fprintf(f, "event_next %lld\n", ev_top() / SECOND_IN_NANOS);
+	}
+	if (cfg_file) {
+		fprintf(f, "config_reloads %lu\n", cfg_reloads);
+		fprintf(f, "config_rejected %lu\n", cfg_rejected);
+		const struct config *cfg = cfg_adopted;
+		if (cfg && cfg->ignored[0]) fprintf(f, "config_restart_needed %s\n", cfg->ignored);
+	}
+	if (time_source == TS_ZONES) {
+		fprintf(f, "zone_rotate %d\n", zone_rotate);
+		for(int i = 0; i < zone_count; i++) {
+			const struct zone *z = &zone_table[i];
+			fprintf(f, "zone %s %+d", z->name, z->offset[z->cur]);
+			if (z->cur + 1 < z->count) fprintf(f, " next %lld %+d", z->at[z->cur + 1], z->offset[z->cur + 1]);
+			fprintf(f, "\n");
+		}
+	}
+	if (time_source == TS_COUNTDOWN) {
+		static const char *after_names[] = { "hold", "blink", "up" };
+		fprintf(f, "countdown_target %lld %s\n", leap_to_posix(countdown_target) / SECOND_IN_NANOS, after_names[countdown_after]);
+		fprintf(f, "countdown_zeros %lu\n", stat_countdown_zeros);
+		if (stat_countdown_zeros) {
+			fprintf(f, "countdown_zero_error_us %.1f\n", stat_countdown_error / 1000.0);
+			fprintf(f, "countdown_zero_error_max_us %.1f\n", stat_countdown_error_max / 1000.0);
+		}
+	}
+	if (stopwatch) {
+		if (stat_commands) fprintf(f, "command_latency_mean_us %.1f\n", stat_command_latency / (double)stat_commands);
+		fprintf(f, "command_latency_max_us %lu\n", stat_command_latency_max);
+		fprintf(f, "command_latency_over_frame %lu\n", stat_command_over);
+	}
+	fprintf(f, "sched %s\n", sched_report);
+	if (cpu_pin >= 0) fprintf(f, "cpu %d\n", cpu_pin);
+	perf_write_stats(f);
+	if (fclose(f) || rename(tmp_file, stats_file)) {
+		perror("write_stats");
+	}
 }
 
 int main(int argc, char **argv) {
@@ -264,8 +1650,22 @@ int main(int argc, char **argv) {
 	unsigned char brightness = 15; // 0-15
 	unsigned char background = 1;
 
+	const char *trace_file = NULL;
+	const char *spi0_file = NULL;
+	long long sim_from = 0, sim_until = 0;
+	const char *leap_file = NULL;
+	const char *control_file = NULL;
+	unsigned char countdown = 0;
+	const char *zones = NULL;
+
+	// Run as side_clock, we're the sidereal clock.
+	const char *name = strrchr(argv[0], '/');
+	name = name?name + 1:argv[0];
+	if (!strcmp(name, "side_clock")) time_source = TS_SIDEREAL;
+
+	static const char options[] = "aA:C:D2Bb:cdeE:f:FHi:Kl:L:m:M:nN:o:p:P:Q:r:StuU:V:w:WY:z:Z:";
 	int c;
-	while((c = getopt(argc, argv, "2Bb:cdt")) > 0) {
+	while((c = getopt(argc, argv, options)) > 0) {
 		switch(c) {
 			case '2':
 				ampm = 0;
@@ -279,9 +1679,166 @@ int main(int argc, char **argv) {
 			case 'c':
 				colon = 0;
 				break;	
+			case 'A':
+				cpu_pin = atoi(optarg);
+				break;
+			case 'C':
+				if (countdown_parse(optarg, &countdown_target, &countdown_after)) {
+					fprintf(stderr, "Bad countdown: %s\n", optarg);
+					usage();
+					exit(1);
+				}
+				countdown = 1;
+				break;
+			case 'D':
+				deadline_enable = 1;
+				break;
 			case 'd':
 				background = 0;
 				break;	
+			case 'e':
+				perf_enable = 1;
+				break;
+			case 'E':
+				ev_file = optarg;
+				break;
+			case 'f':
+				cfg_file = optarg;
+				break;
+			case 'F':
+				flip_enable = 1;
+				break;
+			case 'H':
+				hhmm = 1;
+				break;
+			case 'K':
+				hw_blink = 1;
+				break;
+			case 'W':
+				stopwatch = 1;
+				break;
+			case 'w':
+				housekeeping_slack = strtoul(optarg, NULL, 10);
+				break;
+			case 'i':
+				if (bright_parse(optarg)) {
+					fprintf(stderr, "Bad brightness schedule: %s\n", optarg);
+					usage();
+					exit(1);
+				}
+				break;
+			case 'o':
+				if (off_parse(optarg)) {
+					fprintf(stderr, "Bad display off windows: %s\n", optarg);
+					usage();
+					exit(1);
+				}
+				break;
+			case 'l':
+				longitude = atof(optarg);
+				if (time_source != TS_SIDEREAL06) time_source = TS_SIDEREAL;
+				break;
+			case 'a':
+				apparent = 1;
+				if (time_source != TS_SIDEREAL06) time_source = TS_SIDEREAL;
+				break;
+			case 'S':
+				if (time_source != TS_SIDEREAL06) time_source = TS_SIDEREAL;
+				break;
+			case 'U':
+				if (*optarg && dut1_load(optarg) < 0) {
+					perror(optarg);
+					exit(1);
+				}
+				time_source = TS_SIDEREAL06;
+				break;
+			case 'u':
+				time_source = TS_UTC;
+				break;
+			case 'V': {
+				sim_from = parse_when(optarg);
+				const char *hours = strchr(optarg, ',');
+				if (sim_from == 0) {
+					fprintf(stderr, "Bad simulation start: %s\n", optarg);
+					usage();
+					exit(1);
+				}
+				sim_until = sim_from + (long long)((hours?atof(hours + 1):24.0) * 3600 * SECOND_IN_NANOS);
+				break;
+			}
+			case 'L':
+				if (!strcmp(optarg, "tai")) {
+					leap_mode = LEAP_TAI;
+				} else if (!strncmp(optarg, "smear", 5) && (optarg[5] == 0 || optarg[5] == ':')) {
+					leap_mode = LEAP_SMEAR;
+					if (optarg[5] == ':') leap_smear = (long long)(atof(optarg + 6) * 3600) * SECOND_IN_NANOS;
+					if (leap_smear < 2 * SECOND_IN_NANOS) {
+						usage();
+						exit(1);
+					}
+				} else {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'Y':
+				leap_file = optarg;
+				break;
+			case 'z':
+				zones = optarg;
+				break;
+			case 'Z':
+				zone_rotate = atoi(optarg);
+				if (zone_rotate < 1) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'm':
+				msg_set(optarg);
+				break;
+			case 'M':
+				spi0_file = optarg;
+				break;
+			case 'n':
+				ntp_enable = 1;
+				break;
+			case 'N':
+				ntp_threshold = atol(optarg);
+				if (ntp_threshold <= 0) {
+					usage();
+					exit(1);
+				}
+				ntp_enable = 1;
+				break;
+			case 'p':
+				rt_policy = SCHED_FIFO;
+				rt_priority = atoi(optarg);
+				if (rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO)) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'P':
+				if (!strcmp(optarg, "late")) {
+					miss_policy = POLICY_LATE;
+				} else if (!strcmp(optarg, "skip")) {
+					miss_policy = POLICY_SKIP;
+				} else if (!strncmp(optarg, "degrade", 7) && (optarg[7] == 0 || optarg[7] == ':')) {
+					miss_policy = POLICY_DEGRADE;
+					if (optarg[7] == ':') miss_threshold = atoi(optarg + 8);
+					if (miss_threshold < 1) miss_threshold = 1;
+				} else {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'Q':
+				control_file = optarg;
+				break;
+			case 'r':
+				trace_file = optarg;
+				break;
 			case 't':
 				tenth_enable = 0;
 				break;	
@@ -291,88 +1848,237 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (background) {
-		if (daemon(0, 0)) {
-			perror("daemon");
+	if (countdown) {
+		if (time_source != TS_CIVIL || stopwatch) {
+			fprintf(stderr, "-C counts down in real time. Not with -S, -u or -W.\n");
+			usage();
 			exit(1);
 		}
+		if (countdown_after == CD_BLINK && colon && colon_blink && hw_blink) {
+			fprintf(stderr, "-K needs the blink timer for the colons\n");
+			usage();
+			exit(1);
+		}
+		time_source = TS_COUNTDOWN;
 	}
 
-	struct sched_param sp;
-	sp.sched_priority = (sched_get_priority_max(SCHED_RR) - sched_get_priority_min(SCHED_RR))/2;
-	if (sched_setscheduler(0, SCHED_RR, &sp)) {
-		perror("sched_setscheduler");
-		exit(1);
+	if (zones) {
+		if (time_source != TS_CIVIL || stopwatch) {
+			fprintf(stderr, "-z is for local time. Not with -C, -S, -u or -W.\n");
+			usage();
+			exit(1);
+		}
+		// Far enough back for a simulation, too.
+		long long from = time(NULL);
+		if (sim_from && sim_from / SECOND_IN_NANOS < from) from = sim_from / SECOND_IN_NANOS;
+		if (zone_load(zones, from)) {
+			fprintf(stderr, "Bad time zones (at most %d): %s\n", ZONE_MAX, zones);
+			usage();
+			exit(1);
+		}
+		time_source = TS_ZONES;
 	}
 
-	pthread_attr_t my_pthread_attr;
-	if (pthread_attr_init(&my_pthread_attr) != 0) {
-		perror("pthread_attr_init");
-		exit(1);
+	if (ev_file) {
+		if (stopwatch || countdown) {
+			fprintf(stderr, "-E is for the clock. Not with -C or -W.\n");
+			usage();
+			exit(1);
+		}
+		int bad;
+		if (ev_load(ev_file, &bad) < 0) {
+			if (bad) fprintf(stderr, "%s: line %d is no good\n", ev_file, bad);
+			else perror(ev_file);
+			exit(1);
+		}
 	}
-	if (pthread_attr_setdetachstate(&my_pthread_attr, PTHREAD_CREATE_DETACHED) != 0) {
-		perror("pthread_attr_setdetachstate");
-		exit(1);
+
+	if (cfg_file) {
+		if (stopwatch || sim_from) {
+			fprintf(stderr, "-f is for the clock. Not with -V or -W.\n");
+			usage();
+			exit(1);
+		}
+		// What the file's options go over.
+		cfg_base.brightness = brightness;
+		cfg_base.ampm = ampm;
+		cfg_base.colon = colon;
+		cfg_base.colon_blink = colon_blink;
+		cfg_base.tenth_enable = tenth_enable;
+		cfg_base.hhmm = hhmm;
+		cfg_base.hw_blink = hw_blink;
+		cfg_base.ntp_enable = ntp_enable;
+		cfg_base.ntp_threshold = ntp_threshold;
+		cfg_base.bright_count = bright_count;
+		memcpy(cfg_base.bright_table, bright_table, sizeof(bright_table));
+		cfg_base.off_count = off_count;
+		memcpy(cfg_base.off_table, off_table, sizeof(off_table));
+		cfg_optstring = options;
+		// The first tick takes it up. Until then, it's the lamp test.
+		if (cfg_load(cfg_file)) {
+			fprintf(stderr, "%s is no good\n", cfg_file);
+			exit(1);
+		}
+		brightness = cfg_published->brightness;
 	}
-	if (pthread_attr_setschedpolicy(&my_pthread_attr, SCHED_RR) != 0) {
-		perror("pthread_attr_setschedpolicy");
-		exit(1);
+
+	if (leap_mode) {
+		if (TS_IS_SIDEREAL(time_source)) {
+			fprintf(stderr, "-L is for local time and UTC\n");
+			usage();
+			exit(1);
+		}
+		// The default file is optional. One that's asked for isn't.
+		if (leap_load(leap_file?leap_file:LEAP_FILE) < 0 && leap_file != NULL) {
+			perror(leap_file);
+			exit(1);
+		}
+		tick_clock = CLOCK_TAI;
+		if (sim_from) {
+			leap_refresh(sim_from, 0);
+			sim_until = leap_tai(sim_until);
+			sim_from = leap_tai(sim_from);
+		} else {
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			leap_refresh((long long)now.tv_sec * SECOND_IN_NANOS + now.tv_nsec, 1);
+			if (leap_now->offset == 0) {
+				fprintf(stderr, "The kernel doesn't know TAI - UTC. Is ntpd or chrony told about leap seconds?\n");
+			}
+		}
+		// The countdown's target is on the tick clock too.
+		if (countdown) countdown_target = leap_tai(countdown_target);
 	}
-	sp.sched_priority = (sched_get_priority_max(SCHED_RR) - sched_get_priority_min(SCHED_RR))/2;
-	if (pthread_attr_setschedparam(&my_pthread_attr, &sp) != 0) {
-		perror("pthread_attr_setschedparam");
+
+	if (stopwatch && deadline_enable) {
+		fprintf(stderr, "-D is for the clock. Not with -W.\n");
+		usage();
 		exit(1);
 	}
-	struct sigevent my_sigevent;
-	my_sigevent.sigev_notify = SIGEV_THREAD;
-	my_sigevent.sigev_value.sival_int = 0;
-	my_sigevent.sigev_notify_function = update_display;
-	my_sigevent.sigev_notify_attributes = &my_pthread_attr;
-	if (timer_create(CLOCK_REALTIME, &my_sigevent, (timer_t*)&timer_id) != 0) {
-		perror("timer_create");
+
+	if (stopwatch && sim_from) {
+		fprintf(stderr, "-V can't simulate the stopwatch\n");
+		usage();
 		exit(1);
 	}
-	if (pthread_attr_destroy(&my_pthread_attr) != 0) {
-		perror("pthread_attr_destroy");
-		exit(1);
+
+	if (sim_from) {
+		// Nothing real: no device, no scheduling, no trace. Just the
+		// display code and what it would send.
+		sim_clock = sim_from;
+		write_reg(MAX_REG_CONFIG, MAX_REG_CONFIG_R | MAX_REG_CONFIG_S);
+		write_reg(MAX_REG_SCAN_LIMIT, 7);
+		write_reg(MAX_REG_INTENSITY, brightness);
+		simulate(sim_from, sim_until);
+		exit(0);
 	}
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-		perror("mlockall");
+	// Before daemon(), so that we can still complain. The stopwatch and
+	// countdown aren't much use without it. The clock can do without.
+	if (control_file == NULL) control_file = TS_IS_SIDEREAL(time_source)?SIDEREAL_CONTROL_FILE:CONTROL_FILE;
+	if (*control_file && ctl_open(control_file)) {
+		perror(control_file);
+		if (stopwatch || countdown) exit(1);
 	}
 
-	spi_fd = open("/dev/spidev0.0", O_RDWR);
-	if (spi_fd < 0) {
-		perror("Error opening device");
+	if (background) {
+		if (daemon(0, 0)) {
+			perror("daemon");
+			exit(1);
+		}
+	}
+	if (notify_open()) {
+		perror("NOTIFY_SOCKET");
+	}
+
+	if (TS_IS_SIDEREAL(time_source)) {
+		stats_file = SIDEREAL_STATS_FILE;
+		if (trace_file == NULL) trace_file = SIDEREAL_TRACE_FILE;
+	}
+	if (trace_file == NULL) trace_file = TRACE_FILE;
+
+	// The stats dump request (and the display thread's nudge) is collected
+	// in the main loop below. Block them before any threads exist so they
+	// all inherit that.
+	sigset_t stats_sigs;
+	sigemptyset(&stats_sigs);
+	sigaddset(&stats_sigs, SIGUSR1);
+	sigaddset(&stats_sigs, SIGUSR2);
+	// The stopwatch's kick is collected by the display thread itself.
+	sigset_t block_sigs = stats_sigs;
+	sigaddset(&block_sigs, SIGRTMIN);
+	if (pthread_sigmask(SIG_BLOCK, &block_sigs, NULL) != 0) {
+		perror("pthread_sigmask");
 		exit(1);
 	}
 
-	if (flock(spi_fd, LOCK_EX | LOCK_NB) < 0) {
-		perror("Error locking device");
+	// SCHED_DEADLINE starts out as SCHED_FIFO while the handler is measured.
+	if (deadline_enable && rt_policy == SCHED_RR) rt_policy = SCHED_FIFO;
+	if (rt_priority < 0) {
+		rt_priority = (sched_get_priority_max(rt_policy) - sched_get_priority_min(rt_policy))/2;
+	}
+	struct sched_param sp;
+	sp.sched_priority = rt_priority;
+	if (sched_setscheduler(0, rt_policy, &sp)) {
+		perror("sched_setscheduler");
 		exit(1);
 	}
 
-	// Clock is active high, latching on leading edge.
-	int spi_mode = SPI_MODE_0;
-	int spi_bits = 8;
-	// Device max is 26 MHz. Let's ask for 20 MHz.
-	int spi_speed = 20000000;
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		perror("mlockall");
+	}
 
-	if (ioctl(spi_fd, SPI_IOC_WR_MODE, &spi_mode)) {
-		perror("ioctl(SPI_IOC_WR_MODE)");
-		exit(1);
+	// The trace goes in after mlockall(), so it's locked down too.
+	if (*trace_file && trace_open(trace_file, FUDGE)) {
+		perror(trace_file);
 	}
-	if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &spi_bits)) {
-		perror("ioctl(SPI_IOC_WR_BITS_PER_WORD)");
-		exit(1);
+
+	// An emulated controller doesn't need the real device. Otherwise, spidev
+	// sets up the pins and the lock, even if we then go around it.
+	if (spi0_file == NULL || !strcmp(spi0_file, "/dev/mem")) {
+		spi_fd = open("/dev/spidev0.0", O_RDWR);
+		if (spi_fd < 0) {
+			perror("Error opening device");
+			exit(1);
+		}
+
+		if (flock(spi_fd, LOCK_EX | LOCK_NB) < 0) {
+			perror("Error locking device");
+			exit(1);
+		}
+
+		// Clock is active high, latching on leading edge.
+		int spi_mode = SPI_MODE_0;
+		int spi_bits = 8;
+		// Device max is 26 MHz. Let's ask for 20 MHz.
+		int spi_speed = 20000000;
+
+		if (ioctl(spi_fd, SPI_IOC_WR_MODE, &spi_mode)) {
+			perror("ioctl(SPI_IOC_WR_MODE)");
+			exit(1);
+		}
+		if (ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &spi_bits)) {
+			perror("ioctl(SPI_IOC_WR_BITS_PER_WORD)");
+			exit(1);
+		}
+		if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed)) {
+			perror("ioctl(SPI_IOC_WR_MAX_SPEED_HZ)");
+			exit(1);
+		}
 	}
-	if (ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_speed)) {
-		perror("ioctl(SPI_IOC_WR_MAX_SPEED_HZ)");
+
+	if (spi0_file != NULL && spi0_open(spi0_file)) {
+		perror(spi0_file);
 		exit(1);
 	}
 
 	signal(SIGINT, cleanup);
 	signal(SIGTERM, cleanup);
+	// Not SA_RESTART: the display thread's sleep is meant to be interrupted.
+	struct sigaction kick_action;
+	memset(&kick_action, 0, sizeof(kick_action));
+	kick_action.sa_handler = kick;
+	sigaction(SIGRTMIN, &kick_action, NULL);
 
 	// Turn off the shut-down register, clear the digit data
 	write_reg(MAX_REG_CONFIG, MAX_REG_CONFIG_R | MAX_REG_CONFIG_S);
@@ -383,15 +2089,126 @@ int main(int argc, char **argv) {
 	sleep(1);
 	write_reg(MAX_REG_TEST, 0);
 
-	// Force the first update. It will schedule everything after.
-	union sigval ignore;
-	update_display(ignore);
+	struct timespec start_spec;
+	clock_gettime(CLOCK_MONOTONIC, &start_spec);
+	start_time = start_spec.tv_sec;
+
+	// So that the first tick already knows.
+	if (ntp_enable) ntp_poll();
 
+	// Force the first update. It will schedule everything after. (The
+	// stopwatch starts out at zero by itself.)
+	if (!stopwatch) {
+		update_any();
+		notify_send("READY=1");
+	}
+
+	pthread_attr_t my_pthread_attr;
+	if (pthread_attr_init(&my_pthread_attr) != 0) {
+		perror("pthread_attr_init");
+		exit(1);
+	}
+	if (pthread_attr_setdetachstate(&my_pthread_attr, PTHREAD_CREATE_DETACHED) != 0) {
+		perror("pthread_attr_setdetachstate");
+		exit(1);
+	}
+	if (pthread_attr_setinheritsched(&my_pthread_attr, PTHREAD_EXPLICIT_SCHED) != 0) {
+		perror("pthread_attr_setinheritsched");
+		exit(1);
+	}
+	if (pthread_attr_setschedpolicy(&my_pthread_attr, rt_policy) != 0) {
+		perror("pthread_attr_setschedpolicy");
+		exit(1);
+	}
+	sp.sched_priority = rt_priority;
+	if (pthread_attr_setschedparam(&my_pthread_attr, &sp) != 0) {
+		perror("pthread_attr_setschedparam");
+		exit(1);
+	}
+	main_tid = pthread_self();
+	if (pthread_create(&display_tid, &my_pthread_attr, display_thread, NULL) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	if (pthread_attr_destroy(&my_pthread_attr) != 0) {
+		perror("pthread_attr_destroy");
+		exit(1);
+	}
+	if (ctl_fd >= 0) {
+		// Created while we're still real time, so it is too. The time a
+		// command arrived is noted there, and it has to be right.
+		ctl_target = display_tid;
+		ctl_signal = SIGRTMIN;
+		pthread_t ctl_tid;
+		if (pthread_create(&ctl_tid, NULL, ctl_thread, NULL) != 0) {
+			perror("pthread_create(control)");
+			exit(1);
+		}
+		pthread_detach(ctl_tid);
+	}
+
+	// The housekeeping needs neither real time nor punctuality. Off the
+	// real time scheduler, the kernel honors our timer slack and can fold
+	// our timer into some other wakeup.
+	sp.sched_priority = 0;
+	if (sched_setscheduler(0, SCHED_OTHER, &sp)) {
+		perror("sched_setscheduler(housekeeping)");
+	}
+	if (prctl(PR_SET_TIMERSLACK, housekeeping_slack * 1000UL, 0, 0, 0)) {
+		perror("prctl(PR_SET_TIMERSLACK)");
+	}
+	if (cfg_file) {
+		// Created after we've dropped off the real time scheduler, so it
+		// has too.
+		pthread_t cfg_tid;
+		if (pthread_create(&cfg_tid, NULL, config_thread, NULL) != 0) {
+			perror("pthread_create(config)");
+			exit(1);
+		}
+		pthread_detach(cfg_tid);
+	}
+
+	time_t stats_next = 0;
 	while(1) {
-		// Dirt nap
-		if (select(0, NULL, NULL, NULL, NULL) < 0) {
-			perror("select");
+		// With -n, the housekeeping comes around more often, but the stats
+		// are still only written once a minute. (-n can come and go with -f.)
+		int interval = (ntp_enable && !stopwatch)?NTP_INTERVAL:STATS_INTERVAL;
+		// systemd's watchdog wants feeding twice as often as it bites.
+		if (notify_watchdog && interval > notify_watchdog / 2000000) {
+			interval = (notify_watchdog >= 2000000)?(int)(notify_watchdog / 2000000):1;
+		}
+		// Dirt nap, waking up now and then to publish the stats. Usually
+		// the display thread wakes us first, right after a tick.
+		struct timespec now;
+		clock_gettime(tick_clock, &now);
+		housekeeping_due = ((long long)now.tv_sec + interval) * SECOND_IN_NANOS + now.tv_nsec;
+		struct timespec stats_interval = { interval, 0 };
+		int sig = sigtimedwait(&stats_sigs, NULL, &stats_interval);
+		if (sig < 0 && errno != EAGAIN && errno != EINTR) {
+			perror("sigtimedwait");
 			exit(1);
 		}
+		stat_housekeeping++;
+		if (sig == SIGUSR2) stat_coalesced++;
+		if (ntp_enable) ntp_poll();
+		// The display thread could be asleep through an off window, and
+		// the new events might need it before then.
+		if (ev_file && ev_check(ev_file)) pthread_kill(display_tid, SIGRTMIN);
+		if (notify_watchdog) {
+			if (display_healthy()) {
+				notify_send("WATCHDOG=1");
+				stat_watchdog++;
+			} else {
+				stat_watchdog_withheld++;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (sig != SIGUSR1 && now.tv_sec < stats_next) continue;
+		stats_next = now.tv_sec + STATS_INTERVAL;
+		if (leap_mode) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			leap_refresh((long long)now.tv_sec * SECOND_IN_NANOS + now.tv_nsec, 1);
+		}
+		write_stats();
 	}
 }
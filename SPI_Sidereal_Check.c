@@ -0,0 +1,312 @@
+/*
+
+SPI Clock sidereal time checker
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+This checks the sidereal time code in sidereal.h. First, era00() and
+gmst06() against the values the SOFA library's own tests expect of
+iauEra00() and iauGmst06(). Then the fixed point per-day path the clock
+actually uses against gmst06() done the long way, at a lot of random
+instants. Then the equation of the equinoxes against iauEqeq94(), and what
+cutting the nutation series shorter costs in accuracy and saves in time.
+It prints what it found, and exits with 1 if anything is off by more than
+it should be.
+
+With -y, it also goes over whole years (every second, or every -s seconds)
+with the batch version of the fast path, sr_day_batch(), and says how fast
+that goes and how far it is from the long way. Checking every instant the
+long way would take all day, so that's only every -k'th one. -T writes a
+table of when each sidereal second starts: a line for each UTC day with
+its MJD, when the first sidereal second boundary in it falls (ns after 0h
+UTC), how long a sidereal second is (ns of UTC) and how many start that
+day.
+
+*/
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 199309L
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "sidereal.h"
+
+// Reference values from the SOFA test suite (t_sofa_c.c)
+#define REF_ERA00 0.4022837240028158102 // iauEra00(2400000.5, 54388.0)
+#define REF_GMST06 1.754174971870091203 // iauGmst06(2400000.5, 53736.0, 2400000.5, 53736.0)
+#define REF_TOLERANCE 1e-12 // radians
+#define REF_EQEQ94 5.357758254609256894e-5 // iauEqeq94(2400000.5, 41234.0)
+// Ours has only the biggest terms of the series, so isn't as close.
+#define EQEQ_TOLERANCE 1e-7 // radians
+
+// How far the fast path may be from the long way, in ns
+#define FAST_TOLERANCE 1000
+
+static int failures = 0;
+
+static void usage() {
+	printf("Usage: sidcheck [-k n][-l n][-n count][-s secs][-T file][-U file][-y from-to]\n");
+	printf("   -k : with -y, check every n'th instant the long way (default 64)\n");
+	printf("   -l : Longitude east (negative for west). Default is 0.\n");
+	printf("   -n : how many random instants to try (default 1000000)\n");
+	printf("   -s : with -y, seconds between instants (default 1)\n");
+	printf("   -T : with -y, write a table of sidereal second boundaries to this file\n");
+	printf("   -U : IERS finals file for UT1-UTC\n");
+	printf("   -y : go over these years (UTC) with the batch code, like 2000-2099\n");
+}
+
+static void check_ref(const char *what, double got, double want, double tolerance) {
+	double err = got - want;
+	if (err < 0) err = -err;
+	int ok = err <= tolerance;
+	printf("%-8s %.16f want %.16f err %.3g %s\n", what, got, want, err, ok?"ok":"FAIL");
+	if (!ok) failures++;
+}
+
+// The difference between two times of day, in ns, allowing for midnight.
+static long long day_diff(long long a, long long b) {
+	long long d = (a - b) % SR_DAY_IN_NANOS;
+	if (d > SR_DAY_IN_NANOS / 2) d -= SR_DAY_IN_NANOS;
+	if (d < -SR_DAY_IN_NANOS / 2) d += SR_DAY_IN_NANOS;
+	return d;
+}
+
+// gmst06_nanos() the long way: DUT1 interpolated for the instant itself,
+// and the whole of gmst06() evaluated there.
+static long long slow_nanos(long long t) {
+	long long day = t / SR_DAY_IN_NANOS;
+	int mjd = SR_MJD_EPOCH + (int)day;
+	double frac = (double)(t - day * SR_DAY_IN_NANOS) / SR_DAY_IN_NANOS;
+	double dut1 = dut1_at(mjd) + (dut1_at(mjd + 1) - dut1_at(mjd)) * frac;
+	double g = gmst06(SR_DJM0 + mjd, frac + dut1 / 86400.0, SR_DJM0 + mjd, frac + SR_TT_MINUS_UTC / 86400.0);
+	double st = (g / SR_2PI + longitude / 360.0) * SR_DAY_IN_NANOS;
+	st -= SR_DAY_IN_NANOS * (double)(long long)(st / SR_DAY_IN_NANOS);
+	if (st < 0) st += SR_DAY_IN_NANOS;
+	return (long long)st;
+}
+
+static long long rand_between(long long lo, long long hi) {
+	unsigned long long r = ((unsigned long long)random() << 31) ^ (unsigned long long)random();
+	return lo + (long long)(r % (unsigned long long)(hi - lo));
+}
+
+static long long now_nanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SR_SECOND_IN_NANOS + ts.tv_nsec;
+}
+
+// For a few lengths of the nutation series, the most the equation of the
+// equinoxes is off from all of it over this century, in ms of time, and
+// how long working it out takes. The clock does it once a minute.
+static void nutation_table(long count) {
+	static const int lengths[] = { 1, 2, 4, 8, NUT_TERMS_USED, 20, NUT_TERMS };
+	if (count > 100000) count = 100000;
+	if (count <= 0) return;
+	printf("terms  max err (ms)  ns/eval\n");
+	for(int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++) {
+		double max = 0;
+		srandom(2);
+		for(long j = 0; j < count; j++) {
+			double date2 = rand_between(51544, 88069);
+			double err = eqeq94(SR_DJM0, date2, lengths[i]) - eqeq94(SR_DJM0, date2, NUT_TERMS);
+			if (err < 0) err = -err;
+			if (err > max) max = err;
+		}
+		volatile double sink = 0;
+		long long start = now_nanos();
+		for(long j = 0; j < count; j++) sink += eqeq94(SR_DJM0, 51544 + j * 0.37, lengths[i]);
+		long long took = now_nanos() - start;
+		printf("%5d  %12.4f  %7.1f%s\n", lengths[i], max / SR_2PI * 86400000.0, (double)took / count,
+			(lengths[i] == NUT_TERMS_USED)?"  (clock)":"");
+	}
+}
+
+// Days from 1970-01-01 to 1 January of the given year.
+static long year_day(int year) {
+	long y = year - 1;
+	return 365L * (year - 1970) + (y / 4 - y / 100 + y / 400) - (1969 / 4 - 1969 / 100 + 1969 / 400);
+}
+
+// Evaluations per second, given how many took how long.
+static double per_second(double count, long long nanos) {
+	return nanos?count * SR_SECOND_IN_NANOS / nanos:0;
+}
+
+static uint32_t batch_sec[86400];
+static uint64_t batch_out[86400];
+
+// Go over every step'th second of the days from first up to last, with
+// sr_day_batch(), and check every sample'th one against slow_nanos().
+static void batch(long first, long last, int step, long sample, FILE *table) {
+	long long kernel = 0, days = 0;
+	double evals = 0;
+	long long max = 0, checked = 0;
+	long double sq = 0;
+	long long offset = 0; // of the next instant from the start of the day
+	for(long day = first; day < last; day++) {
+		struct sr_day d;
+		long long start = now_nanos();
+		sr_day_compute(&d, day);
+		days += now_nanos() - start;
+		int n = 0;
+		for(; offset < 86400; offset += step) batch_sec[n++] = (uint32_t)offset;
+		offset -= 86400;
+		start = now_nanos();
+		sr_day_batch(&d, batch_sec, batch_out, n);
+		kernel += now_nanos() - start;
+		evals += n;
+		for(int i = 0; i < n; i += sample) {
+			long long t = d.start + batch_sec[i] * SR_SECOND_IN_NANOS;
+			long long err = day_diff((long long)batch_out[i], slow_nanos(t));
+			if (err < 0) err = -err;
+			if (err > max) max = err;
+			sq += (long double)err * err;
+			checked++;
+		}
+		if (table != NULL) {
+			// Sidereal time goes up per_sec fixed point units a second.
+			// (per_ns is coarser, and only has to be good for one.)
+			uint64_t sec_fp = (uint64_t)SR_SECOND_IN_NANOS << SR_FP_SHIFT;
+			double period = (double)sec_fp * SR_SECOND_IN_NANOS / d.per_sec;
+			double until = (double)(sec_fp - d.base % sec_fp) * SR_SECOND_IN_NANOS / d.per_sec;
+			if (d.base % sec_fp == 0) until = 0;
+			long count = (long)((SR_DAY_IN_NANOS - until) / period) + 1;
+			fprintf(table, "%ld %.3f %.6f %ld\n", SR_MJD_EPOCH + day, until, period, count);
+		}
+	}
+	int ok = max <= FAST_TOLERANCE;
+	long double rms = checked?sq / checked:0;
+	long double root = rms > 1?rms / 2:1;
+	for(int i = 0; i < 64; i++) root = (root + rms / root) / 2;
+	printf("batch: %.0f instants over %ld days, %lld checked: max %lld ns, rms %.1f ns %s\n", evals, last - first,
+		checked, max, (double)root, ok?"ok":"FAIL");
+	printf("batch: %.3g evals/s in sr_day_batch(), %.3g days/s in sr_day_compute()\n",
+		per_second(evals, kernel), per_second(last - first, days));
+	if (!ok) failures++;
+
+	// And the ones the clock calls for each tick, for comparison.
+	long n = 1000000;
+	volatile long long sink = 0;
+	long long t = first * SR_DAY_IN_NANOS;
+	long long start = now_nanos();
+	for(long i = 0; i < n; i++) sink += gmst06_nanos(t + i * (SR_SECOND_IN_NANOS / 10));
+	long long took = now_nanos() - start;
+	printf("per tick: %.3g evals/s in gmst06_nanos()", per_second(n, took));
+	start = now_nanos();
+	for(long i = 0; i < n; i++) sink += sidereal_nanos(t + i * (SR_SECOND_IN_NANOS / 10));
+	took = now_nanos() - start;
+	printf(", %.3g evals/s in sidereal_nanos()\n", per_second(n, took));
+}
+
+int main(int argc, char **argv) {
+	long count = 1000000;
+	int year_from = 0, year_to = 0, step = 1;
+	long sample = 64;
+	FILE *table = NULL;
+
+	int c;
+	while((c = getopt(argc, argv, "k:l:n:s:T:U:y:")) > 0) {
+		switch(c) {
+			case 'l':
+				longitude = atof(optarg);
+				break;
+			case 'k':
+				sample = atol(optarg);
+				if (sample < 1) sample = 1;
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 's':
+				step = atoi(optarg);
+				if (step < 1 || step > 86400) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'T':
+				table = fopen(optarg, "w");
+				if (table == NULL) {
+					perror(optarg);
+					exit(1);
+				}
+				break;
+			case 'y':
+				if (sscanf(optarg, "%d-%d", &year_from, &year_to) != 2 || year_from < 1970 || year_to < year_from) {
+					usage();
+					exit(1);
+				}
+				break;
+			case 'U':
+				if (dut1_load(optarg) < 0) {
+					perror(optarg);
+					exit(1);
+				}
+				break;
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	check_ref("era00", era00(2400000.5, 54388.0), REF_ERA00, REF_TOLERANCE);
+	check_ref("gmst06", gmst06(2400000.5, 53736.0, 2400000.5, 53736.0), REF_GMST06, REF_TOLERANCE);
+	check_ref("eqeq94", eqeq94(2400000.5, 41234.0, NUT_TERMS), REF_EQEQ94, EQEQ_TOLERANCE);
+
+	// Over the DUT1 table if there is one, otherwise this century.
+	long long lo = (946684800LL) * SR_SECOND_IN_NANOS;
+	long long hi = (4102444800LL) * SR_SECOND_IN_NANOS;
+	if (dut1_count > 1) {
+		lo = (long long)(dut1_first - SR_MJD_EPOCH) * SR_DAY_IN_NANOS;
+		hi = (long long)(dut1_first + dut1_count - 1 - SR_MJD_EPOCH) * SR_DAY_IN_NANOS;
+		printf("DUT1 for MJD %d to %d\n", dut1_first, dut1_first + dut1_count - 1);
+	}
+	srandom(1);
+	long long fast_max = 0, usno_max = 0;
+	long double fast_sq = 0;
+	for(long i = 0; i < count; i++) {
+		long long t = rand_between(lo, hi);
+		long long want = slow_nanos(t);
+		long long fast = day_diff(gmst06_nanos(t), want);
+		long long usno = day_diff(sidereal_nanos(t), want);
+		if (fast < 0) fast = -fast;
+		if (usno < 0) usno = -usno;
+		if (fast > fast_max) fast_max = fast;
+		if (usno > usno_max) usno_max = usno;
+		fast_sq += (long double)fast * fast;
+	}
+	if (count > 0) {
+		int ok = fast_max <= FAST_TOLERANCE;
+		long double rms = fast_sq / count;
+		// A square root, without libm.
+		long double root = rms > 1?rms / 2:1;
+		for(int i = 0; i < 64; i++) root = (root + rms / root) / 2;
+		printf("fixed point vs gmst06 over %ld instants: max %lld ns, rms %.1f ns %s\n", count, fast_max,
+			(double)root, ok?"ok":"FAIL");
+		printf("USNO formula vs gmst06: max %.3f s\n", usno_max / (double)SR_SECOND_IN_NANOS);
+		if (!ok) failures++;
+	}
+	nutation_table(count);
+	if (year_from) batch(year_day(year_from), year_day(year_to + 1), step, sample, table);
+	if (table != NULL) fclose(table);
+	return failures?1:0;
+}
@@ -0,0 +1,214 @@
+/*
+
+SPI Clock trace decoder
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+This reads the per-tick trace ring that the clock keeps (see trace.h) and
+either dumps the records or summarizes them. It only ever reads the file,
+so it's safe to run while the clock is going.
+
+*/
+
+#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#define _FILE_OFFSET_BITS 64
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define SECOND_IN_NANOS (1000L * 1000L * 1000L)
+
+static void usage() {
+	printf("Usage: spitrace [-f file][-m minutes][-s]\n");
+	printf("   -f : trace file (default /run/spiclock.trace)\n");
+	printf("   -m : only the last n minutes (default all of it)\n");
+	printf("   -s : summarize instead of dumping every tick\n");
+}
+
+static int compare_ll(const void *a, const void *b) {
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+// Print min / mean / 99th percentile / max of n values, in microseconds.
+// This sorts the values.
+static void summarize(const char *what, long long *v, unsigned long n) {
+	if (n == 0) {
+		printf("%-14s (none)\n", what);
+		return;
+	}
+	qsort(v, n, sizeof(*v), compare_ll);
+	long double sum = 0;
+	for(unsigned long i = 0; i < n; i++) sum += v[i];
+	printf("%-14s min %9.1f  mean %9.1f  p99 %9.1f  max %9.1f us\n", what,
+		v[0] / 1000.0, (double)(sum / n / 1000.0), v[(n * 99) / 100] / 1000.0, v[n - 1] / 1000.0);
+}
+
+static void flag_string(unsigned short flags, char *buf) {
+	static const char letters[] = "LSECDFOPTKH"; // in TRACE_ bit order
+	for(int i = 0; letters[i]; i++) {
+		buf[i] = (flags & _BV(i))?letters[i]:'-';
+	}
+	buf[strlen(letters)] = 0;
+}
+
+static void dump(const struct trace_record *r) {
+	time_t sec = (time_t)(r->target / SECOND_IN_NANOS);
+	struct tm lt;
+	localtime_r(&sec, &lt);
+	char flags[16];
+	flag_string(r->flags, flags);
+	printf("%04d-%02d-%02d %02d:%02d:%02d.%03d %s wake %+9.1f", lt.tm_year + 1900, lt.tm_mon + 1, lt.tm_mday,
+		lt.tm_hour, lt.tm_min, lt.tm_sec, (int)((r->target % SECOND_IN_NANOS) / 1000000), flags,
+		(r->wakeup - r->target) / 1000.0);
+	if (r->nregs) {
+		printf(" commit %+9.1f %+9.1f ", (r->commit_start - r->target) / 1000.0, (r->commit_end - r->target) / 1000.0);
+		for(int i = 0; i < r->nregs && i < TRACE_MAX_REGS; i++) {
+			printf(" %02x:%02x", r->regs[i][0], r->regs[i][1]);
+		}
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	const char *file = "/run/spiclock.trace";
+	int minutes = 0;
+	int summary = 0;
+
+	int c;
+	while((c = getopt(argc, argv, "f:m:s")) > 0) {
+		switch(c) {
+			case 'f':
+				file = optarg;
+				break;
+			case 'm':
+				minutes = atoi(optarg);
+				break;
+			case 's':
+				summary = 1;
+				break;
+			default:
+				usage();
+				exit(1);
+		}
+	}
+
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		perror(file);
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	if (st.st_size < (off_t)sizeof(struct trace_header)) {
+		fprintf(stderr, "%s: too short to be a trace\n", file);
+		exit(1);
+	}
+	const struct trace_header *hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+	if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION || hdr->record_size != sizeof(struct trace_record)
+		|| st.st_size < (off_t)(sizeof(*hdr) + (size_t)hdr->slots * sizeof(struct trace_record))) {
+		fprintf(stderr, "%s: not a trace file we understand\n", file);
+		exit(1);
+	}
+
+	// Walk backwards from the newest record until we run out, or get to
+	// records older than we were asked for. The writer may lap us while we
+	// do this. Those records just get dropped.
+	struct trace_record *recs = malloc(hdr->slots * sizeof(struct trace_record));
+	if (recs == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	uint32_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	unsigned long n = 0;
+	long long newest = 0;
+	for(uint32_t seq = head - 1; seq != 0 && n < hdr->slots; seq--) {
+		struct trace_record *r = &recs[hdr->slots - 1 - n];
+		if (!trace_read(hdr, seq, r)) break;
+		if (newest == 0) newest = r->target;
+		if (minutes && newest - r->target > minutes * 60LL * SECOND_IN_NANOS) break;
+		n++;
+	}
+	recs += hdr->slots - n; // now oldest first
+
+	if (!summary) {
+		for(unsigned long i = 0; i < n; i++) dump(&recs[i]);
+		return 0;
+	}
+
+	unsigned long counts[11];
+	memset(counts, 0, sizeof(counts));
+	long long *wake = malloc(n * sizeof(long long) + 1);
+	long long *commit = malloc(n * sizeof(long long) + 1);
+	long long *error = malloc(n * sizeof(long long) + 1);
+	if (wake == NULL || commit == NULL || error == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	unsigned long shown = 0, timed = 0, staged = 0;
+	for(unsigned long i = 0; i < n; i++) {
+		const struct trace_record *r = &recs[i];
+		for(int j = 0; j < 11; j++) {
+			if (r->flags & _BV(j)) counts[j]++;
+		}
+		// How far from the intended wakeup (target - FUDGE) we actually were.
+		// A kick has nothing to do with the timer.
+		if (r->flags & TRACE_STAGED) {
+			// Half of a flipped tick (-F). The flip's record has the rest.
+			staged++;
+			continue;
+		}
+		if (!(r->flags & TRACE_KICK)) wake[timed++] = r->wakeup - (r->target - hdr->fudge);
+		if (r->nregs) {
+			commit[shown] = r->commit_end - r->commit_start;
+			// When the last register landed, relative to the target. This is
+			// how wrong the display was.
+			error[shown] = r->commit_end - r->target;
+			shown++;
+		}
+	}
+	if (n) {
+		printf("%lu ticks over %.1f seconds, %lu shown\n", n - staged, (recs[n - 1].target - recs[0].target) / (double)SECOND_IN_NANOS, shown);
+	} else {
+		printf("no ticks\n");
+	}
+	printf("late %lu  skipped %lu  early %lu  catchup %lu  degraded %lu  restarts %lu  off %lu  flipped %lu  text %lu  kicked %lu  staged %lu\n",
+		counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6], counts[7], counts[8], counts[9],
+		counts[10]);
+	summarize("wakeup", wake, timed);
+	summarize("commit", commit, shown);
+	summarize("display error", error, shown);
+	return 0;
+}
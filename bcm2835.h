@@ -0,0 +1,78 @@
+/*
+
+BCM2835 peripheral access for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+This maps blocks of the SoC's peripheral registers into our address space
+through /dev/mem. It only works as root, and only on a Pi, but everything
+here fails gracefully so that callers can fall back to doing things the
+slow way.
+
+*/
+
+#ifndef BCM2835_H
+#define BCM2835_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// The peripherals live at a different physical address on every generation
+// of Pi. The device tree says where. This is the default for the Pi 1 and Zero.
+#define BCM_PERIPHERAL_BASE_DEFAULT 0x20000000UL
+
+// Offsets from the peripheral base
+#define BCM_ST_OFFSET 0x3000 // system timer
+#define BCM_SPI0_OFFSET 0x204000 // SPI0 controller
+
+// The system timer is a free running 1 MHz counter. These are word indices.
+#define BCM_ST_CLO 1
+
+static inline unsigned long bcm_peripheral_base() {
+	unsigned char buf[12];
+	FILE *f = fopen("/proc/device-tree/soc/ranges", "rb");
+	if (f == NULL) return 0; // Not a Pi
+	size_t len = fread(buf, 1, sizeof(buf), f);
+	fclose(f);
+	if (len < 8) return BCM_PERIPHERAL_BASE_DEFAULT;
+	// <bus address> <cpu address> <size> - all big endian. On the Pi 4
+	// the cpu address is two cells wide, and the first of them is 0.
+	unsigned long base = ((unsigned long)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+	if (base == 0 && len >= 12) {
+		base = ((unsigned long)buf[8] << 24) | (buf[9] << 16) | (buf[10] << 8) | buf[11];
+	}
+	return base?base:BCM_PERIPHERAL_BASE_DEFAULT;
+}
+
+// Map len bytes of registers at the given offset from the peripheral base.
+// Returns NULL if we can't. The Pi 4 puts its peripherals above 2 GB, so on
+// a 32 bit system this needs _FILE_OFFSET_BITS=64.
+static inline volatile uint32_t *bcm_map(unsigned long offset, size_t len) {
+	unsigned long base = bcm_peripheral_base();
+	if (base == 0) return NULL;
+	int fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if (fd < 0) return NULL;
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, (off_t)(base + offset));
+	close(fd);
+	if (p == MAP_FAILED) return NULL;
+	return (volatile uint32_t *)p;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/*
+
+Display layers for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The time is always at the bottom. Anything else that wants to be seen (a
+message, which zone it is, and so on) puts up a layer over it: the
+segments it covers on each digit, what they are, how it ranks against the
+other layers and, if it's only for a while, when it comes down. Where two
+layers cover the same segment, the higher priority one wins.
+
+The layers are flattened into one set of masks and segments only when one
+of them changes, comes down or goes up. A tick with nothing changed just
+looks at the masks, and a tick with no layers at all doesn't even do that,
+so the time on its own costs what it always did.
+
+A digit showing the time is usually decoded by the chip (code B). If a
+layer covers more of it than the decimal point, it has to be taken off
+decoding for that tick and drawn from glyph_codeb instead.
+
+All of this belongs to the display thread.
+
+*/
+
+#ifndef COMPOSITOR_H
+#define COMPOSITOR_H
+
+#include <string.h>
+
+#include "font.h"
+
+#define LAYER_DIGITS 8
+// The layers there are. Each has its own slot.
+#define LAYER_ZONE 0 // which time zone, on the misc digit (-z)
+#define LAYER_TEXT 1 // a message
+#define LAYER_NTP 2 // NTP trouble, on the misc digit (-n)
+#define LAYER_MAX 4
+// and how they rank, as a rule
+#define PRIO_ZONE 10
+#define PRIO_NTP 15
+#define PRIO_TEXT 20
+
+struct layer {
+	unsigned char active;
+	unsigned char prio; // higher covers lower
+	long long expires; // tick clock ns, or 0 to stay up
+	unsigned char mask[LAYER_DIGITS]; // the segments it covers
+	unsigned char segs[LAYER_DIGITS]; // and which of those are lit
+};
+
+static struct layer comp_layers[LAYER_MAX];
+static unsigned char comp_dirty = 0;
+static unsigned char comp_count = 0; // how many are up
+static long long comp_expires = 0; // the soonest one comes down, or 0
+// All of them flattened
+static unsigned char comp_mask[LAYER_DIGITS];
+static unsigned char comp_segs[LAYER_DIGITS];
+
+// Put up layer id, or change it. Putting up the same thing again doesn't
+// count as a change.
+static inline void comp_set(int id, unsigned char prio, long long expires, const unsigned char *mask,
+		const unsigned char *segs) {
+	struct layer *l = &comp_layers[id];
+	if (l->active && l->prio == prio && l->expires == expires && !memcmp(l->mask, mask, LAYER_DIGITS)
+			&& !memcmp(l->segs, segs, LAYER_DIGITS)) return;
+	if (!l->active) comp_count++;
+	l->active = 1;
+	l->prio = prio;
+	l->expires = expires;
+	memcpy(l->mask, mask, LAYER_DIGITS);
+	memcpy(l->segs, segs, LAYER_DIGITS);
+	comp_dirty = 1;
+}
+
+static inline void comp_clear(int id) {
+	if (!comp_layers[id].active) return;
+	comp_layers[id].active = 0;
+	comp_count--;
+	comp_dirty = 1;
+}
+
+// Take down whatever has expired as of now, and flatten again if anything
+// changed. Returns how many layers are up.
+static inline int comp_update(long long now) {
+	if (comp_expires && now >= comp_expires) {
+		for(int i = 0; i < LAYER_MAX; i++) {
+			if (comp_layers[i].active && comp_layers[i].expires && now >= comp_layers[i].expires) comp_clear(i);
+		}
+	}
+	if (!comp_dirty) return comp_count;
+	comp_dirty = 0;
+	memset(comp_mask, 0, sizeof(comp_mask));
+	memset(comp_segs, 0, sizeof(comp_segs));
+	comp_expires = 0;
+	// Lowest priority first, so the higher ones go over them. There are
+	// only a few, so pick them out in order rather than sort.
+	int done = 0;
+	for(int last = -1; done < comp_count; ) {
+		int next = 256;
+		for(int i = 0; i < LAYER_MAX; i++) {
+			if (comp_layers[i].active && comp_layers[i].prio > last && comp_layers[i].prio < next) next = comp_layers[i].prio;
+		}
+		if (next == 256) break;
+		for(int i = 0; i < LAYER_MAX; i++) {
+			const struct layer *l = &comp_layers[i];
+			if (!l->active || l->prio != next) continue;
+			for(int j = 0; j < LAYER_DIGITS; j++) {
+				comp_segs[j] = (comp_segs[j] & ~l->mask[j]) | (l->segs[j] & l->mask[j]);
+				comp_mask[j] |= l->mask[j];
+			}
+			if (l->expires && (comp_expires == 0 || l->expires < comp_expires)) comp_expires = l->expires;
+			done++;
+		}
+		last = next;
+	}
+	return comp_count;
+}
+
+// Digit i, with what the layers have over it. value is what's under them,
+// and decoded if its bit is set in *decode_mask - which is cleared if the
+// layers need the digit off decoding.
+static inline unsigned char comp_digit(int i, unsigned char value, unsigned char *decode_mask) {
+	unsigned char m = comp_mask[i];
+	if (m == 0) return value;
+	// Decoding leaves us the decimal point, and nothing else.
+	if ((*decode_mask & _BV(i)) && (m & ~MASK_DP)) {
+		value = glyph_codeb[value & 0xf] | (value & MASK_DP);
+		*decode_mask &= ~_BV(i);
+	}
+	return (value & ~m) | (comp_segs[i] & m);
+}
+
+#endif
@@ -0,0 +1,260 @@
+/*
+
+Configuration file for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+With -f, the clock watches a file of command line options, and when it
+changes, starts doing what it says - no restart, so no lamp test, and the
+display thread keeps its scheduling and whatever it's learned. The file
+can be /etc/default/piclock itself: a PICLOCK_OPTS="..." line is read for
+the options in it, and any other variable set there is left alone.
+Otherwise, every line that isn't a comment is options.
+
+What's in the file goes over what was on the command line, so taking an
+option out of the file goes back to the command line's. Only the options
+for how the display looks can change on the fly:
+
+-2 -b -B -c -H -i -K -n -N -o -t
+
+Anything else has to wait for the next restart. The stats file lists any
+of those the file has. A file with something wrong in it is ignored
+altogether. If there's no file, it's as if it were empty, until there is.
+
+A thread of its own, off the real time scheduler, waits on inotify for
+the file to change (or be replaced - editors usually write a new one and
+rename it over the old), and reads it. Each reading is a complete
+snapshot, published with a pointer store into whichever of two slots the
+display thread isn't using. The display thread takes it up at the start
+of its next tick, copies out what it needs, and says so. Until it has, the
+reader waits before publishing another.
+
+*/
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "timetable.h"
+
+#define CFG_FILE_MAX 4096
+#define CFG_IGNORED 32
+// How long to wait for the display thread to take the last one
+#define CFG_ADOPT_WAIT (10L * 1000L * 1000L)
+
+struct config {
+	unsigned char brightness;
+	unsigned char ampm;
+	unsigned char colon;
+	unsigned char colon_blink;
+	unsigned char tenth_enable;
+	unsigned char hhmm;
+	unsigned char hw_blink;
+	unsigned char ntp_enable;
+	long ntp_threshold;
+	int bright_count;
+	struct bright_entry bright_table[BRIGHT_MAX];
+	int off_count;
+	struct off_window off_table[OFF_MAX];
+	char ignored[CFG_IGNORED]; // options that need a restart
+};
+
+// The command line's, and the two slots for the file's
+static struct config cfg_base;
+static struct config cfg_slots[2];
+static struct config *volatile cfg_published = NULL;
+static struct config *volatile cfg_adopted = NULL;
+static const char *cfg_file = NULL;
+static const char *cfg_optstring = ""; // getopt()'s, for which options take an argument
+static volatile unsigned long cfg_reloads = 0, cfg_rejected = 0;
+
+// One option (and its argument, if it takes one) onto c. Returns 0 if it's
+// all right.
+static inline int cfg_option(struct config *c, char opt, const char *arg) {
+	switch(opt) {
+		case '2': c->ampm = 0; break;
+		case 'b': {
+			char *end;
+			long b = strtol(arg, &end, 10);
+			if (end == arg || *end || b < 0 || b > 15) return -1;
+			c->brightness = (unsigned char)b;
+			break;
+		}
+		case 'B': c->colon_blink = 1; break;
+		case 'c': c->colon = 0; break;
+		case 'H': c->hhmm = 1; break;
+		case 'i': return bright_parse_into(arg, c->bright_table, &c->bright_count);
+		case 'K': c->hw_blink = 1; break;
+		case 'n': c->ntp_enable = 1; break;
+		case 'N':
+			c->ntp_threshold = atol(arg);
+			if (c->ntp_threshold <= 0) return -1;
+			c->ntp_enable = 1;
+			break;
+		case 'o': return off_parse_into(arg, c->off_table, &c->off_count);
+		case 't': c->tenth_enable = 0; break;
+		default: {
+			// Something for next time.
+			size_t len = strlen(c->ignored);
+			if (!strchr(c->ignored, opt) && len + 1 < sizeof(c->ignored)) {
+				c->ignored[len] = opt;
+				c->ignored[len + 1] = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+// Split the next word off *p (in place), dropping quotes. NULL at the end.
+static inline char *cfg_word(char **p) {
+	char *s = *p + strspn(*p, " \t");
+	if (*s == 0) return NULL;
+	char *out = s, *w = s;
+	char quote = 0;
+	for(; *s && (quote || (*s != ' ' && *s != '\t')); s++) {
+		if (!quote && (*s == '"' || *s == '\'')) quote = *s;
+		else if (*s == quote) quote = 0;
+		else *w++ = *s;
+	}
+	*p = *s?s + 1:s;
+	*w = 0;
+	return out;
+}
+
+// The options in one line (with the newline gone) onto c. Returns 0 if
+// they're all right.
+static inline int cfg_line(struct config *c, char *line) {
+	char *p = line + strspn(line, " \t");
+	if (*p == '#' || *p == 0) return 0;
+	if (!strncmp(p, "export ", 7)) p += 7 + strspn(p + 7, " \t");
+	size_t name = strspn(p, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+	if (name > 0 && p[name] == '=') {
+		// A shell variable. Anything but ours is someone else's business.
+		if (name != 12 || strncmp(p, "PICLOCK_OPTS", 12)) return 0;
+		// The shell's quotes around the lot
+		p += 13;
+		size_t len = strlen(p);
+		while(len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t' || p[len - 1] == '\r')) p[--len] = 0;
+		if (len >= 2 && (*p == '"' || *p == '\'') && p[len - 1] == *p) {
+			p[len - 1] = 0;
+			p++;
+		}
+	}
+	char *word;
+	while((word = cfg_word(&p)) != NULL) {
+		if (word[0] != '-' || word[1] == 0) return -1;
+		for(char *o = word + 1; *o; o++) {
+			const char *spec = strchr(cfg_optstring, *o);
+			if (spec == NULL || *o == ':') return -1;
+			if (spec[1] != ':') {
+				if (cfg_option(c, *o, "")) return -1;
+				continue;
+			}
+			// The rest of the word, or the next one.
+			const char *arg = o[1]?o + 1:cfg_word(&p);
+			if (arg == NULL || cfg_option(c, *o, arg)) return -1;
+			break;
+		}
+	}
+	return 0;
+}
+
+// Read the file into the slot the display thread isn't using, and publish
+// it. No file at all is no options: just the command line's. Returns 0 on
+// success.
+static inline int cfg_load(const char *path) {
+	char text[CFG_FILE_MAX];
+	size_t len = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT) return -1;
+	} else {
+		len = fread(text, 1, sizeof(text) - 1, f);
+		int toolong = !feof(f);
+		fclose(f);
+		if (toolong) return -1;
+	}
+	text[len] = 0;
+	struct config *c = (cfg_published == &cfg_slots[0])?&cfg_slots[1]:&cfg_slots[0];
+	*c = cfg_base;
+	c->ignored[0] = 0;
+	for(char *line = strtok(text, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+		if (cfg_line(c, line)) return -1;
+	}
+	__atomic_store_n(&cfg_published, c, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Wait for the display thread to take the last one, then read the file.
+static inline void cfg_reload(const char *path) {
+	struct timespec wait = { 0, CFG_ADOPT_WAIT };
+	while(__atomic_load_n(&cfg_adopted, __ATOMIC_ACQUIRE) != cfg_published) nanosleep(&wait, NULL);
+	if (cfg_load(path)) {
+		cfg_rejected++;
+		fprintf(stderr, "%s: not using it\n", path);
+	} else {
+		cfg_reloads++;
+	}
+}
+
+// Watch the directory rather than the file, so that it's still watched
+// after the file is replaced, and so that it can come and go. kick is
+// called after each new snapshot.
+static inline void cfg_watch(const char *path, void (*kick)(void)) {
+	char dir[256];
+	const char *base = strrchr(path, '/');
+	if (base) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(base - path), path);
+		if (dir[0] == 0) strcpy(dir, "/");
+		base++;
+	} else {
+		strcpy(dir, ".");
+		base = path;
+	}
+	int fd = inotify_init();
+	if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+		perror("inotify");
+		return;
+	}
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	while(1) {
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			perror("read(inotify)");
+			return;
+		}
+		int hit = 0;
+		for(char *p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *)p;
+			if (ev->len && !strcmp(ev->name, base)) hit = 1;
+			p += sizeof(*ev) + ev->len;
+		}
+		if (!hit) continue;
+		cfg_reload(path);
+		kick();
+	}
+}
+
+#endif
@@ -0,0 +1,128 @@
+/*
+
+Control socket for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+Commands come in as datagrams on a Unix socket, one command each, like
+
+echo start | socat - UNIX-SENDTO:/run/spiclock.sock
+
+A thread of its own waits on the socket. It notes the time (CLOCK_MONOTONIC)
+the moment a command arrives, puts it in a little ring for the display
+thread, and kicks the display thread out of its sleep with a signal. The
+display thread does whatever the command says itself, so nothing it owns is
+touched from outside, and there are no locks for it to wait on.
+
+*/
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define CTL_QUEUE 16 // a power of 2
+#define CTL_TEXT 64
+
+struct ctl_cmd {
+	long long when; // CLOCK_MONOTONIC ns, when it arrived
+	char text[CTL_TEXT];
+};
+
+// One writer (the control thread), one reader (the display thread)
+static struct ctl_cmd ctl_queue[CTL_QUEUE];
+static unsigned int ctl_head = 0, ctl_tail = 0;
+static volatile unsigned long ctl_dropped = 0;
+
+static int ctl_fd = -1;
+static pthread_t ctl_target; // who to kick
+static int ctl_signal = 0;
+
+static inline long long ctl_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns 0 on success.
+static inline int ctl_open(const char *path) {
+	struct sockaddr_un addr;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	ctl_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (ctl_fd < 0) return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		int err = errno;
+		close(ctl_fd);
+		ctl_fd = -1;
+		errno = err;
+		return -1;
+	}
+	chmod(path, 0660);
+	return 0;
+}
+
+static void *ctl_thread(void *ignore) {
+	while(1) {
+		char buf[CTL_TEXT];
+		ssize_t len = recv(ctl_fd, buf, sizeof(buf) - 1, 0);
+		long long when = ctl_now();
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			perror("recv(control)");
+			return NULL;
+		}
+		while(len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r' || buf[len - 1] == ' ')) len--;
+		buf[len] = 0;
+		unsigned int head = ctl_head;
+		if (head - __atomic_load_n(&ctl_tail, __ATOMIC_ACQUIRE) == CTL_QUEUE) {
+			ctl_dropped++;
+			continue;
+		}
+		struct ctl_cmd *c = &ctl_queue[head % CTL_QUEUE];
+		c->when = when;
+		strcpy(c->text, buf);
+		__atomic_store_n(&ctl_head, head + 1, __ATOMIC_RELEASE);
+		if (ctl_signal) pthread_kill(ctl_target, ctl_signal);
+	}
+}
+
+// The next command, if there is one. Returns 0 if not.
+static inline int ctl_pop(struct ctl_cmd *out) {
+	unsigned int tail = ctl_tail;
+	if (tail == __atomic_load_n(&ctl_head, __ATOMIC_ACQUIRE)) return 0;
+	*out = ctl_queue[tail % CTL_QUEUE];
+	__atomic_store_n(&ctl_tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,327 @@
+/*
+
+Alarms and other events for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The events file (-E) has one event a line: when, and what to do then.
+
+# Every day
+07:00 blink 30
+# Weekdays, and weekends a bit later
+06:45 mon-fri text Get up
+09:00 sat,sun text Get up
+22:30:00 bright 3
+# Just the once
+2017-12-31 23:59:50 text Happy New Year
+
+The times are local. Days are sun, mon, tue, wed, thu, fri and sat, in
+a list or a range (fri-mon goes round the end of the week). What to do is
+one of
+
+blink [secs] - blink the whole display (10 seconds if it doesn't say)
+text words - show a message, as with the text command
+bright level - change the brightness (0-15), until the schedule says
+otherwise
+
+The display thread keeps the events in a min-heap on when each next
+happens, so a tick only has to compare itself with the top of it, however
+many events there are. When one goes off, when it's next due is worked out
+from the calendar and it goes back down the heap.
+
+The housekeeping watches the file and reads it again when it changes, off
+the real time scheduler, into whichever of two tables the display thread
+isn't using. The display thread takes the new one at its next tick. Any
+event that's the same as before keeps its place in time, so only new or
+changed lines need the calendar.
+
+*/
+
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define EVENT_MAX 256
+#define EVENT_TEXT 64
+#define EV_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+#define EV_DAY (24 * 60 * 60)
+
+#define EV_BLINK 0
+#define EV_TEXT 1
+#define EV_BRIGHT 2
+
+#define EV_BLINK_DEFAULT 10
+#define EV_ALL_DAYS 0x7f
+
+struct event {
+	long long once; // POSIX seconds for a one-off, or 0
+	int when; // otherwise, seconds into the local day
+	unsigned char days; // and on which days (bit tm_wday)
+	unsigned char effect;
+	int arg; // seconds to blink, or the level
+	char text[EVENT_TEXT];
+};
+
+struct ev_table {
+	int count;
+	struct event ev[EVENT_MAX];
+};
+
+// What the housekeeping has read, and what the display thread has taken.
+// The housekeeping only reads the file again once they're the same.
+static struct ev_table ev_slots[2];
+static struct ev_table *volatile ev_published = NULL;
+static struct ev_table *volatile ev_adopted = NULL;
+static const char *ev_file = NULL;
+static struct stat ev_stat; // as of the last read
+
+// The display thread's own copy, and the heap of it
+struct ev_live {
+	long long at; // POSIX ns, when it's next due (0 for never again)
+	struct event e;
+};
+static struct ev_live ev_live[EVENT_MAX];
+static int ev_heap[EVENT_MAX]; // into ev_live, soonest on top
+static int ev_count = 0;
+
+static const char *ev_day_names[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+static inline int ev_day(const char *p) {
+	for(int i = 0; i < 7; i++) {
+		if (!strncmp(p, ev_day_names[i], 3)) return i;
+	}
+	return -1;
+}
+
+// A day list like mon-fri or sat,sun. Returns the bits, or 0 if it isn't one.
+static inline unsigned char ev_parse_days(const char *p, size_t len) {
+	unsigned char days = 0;
+	const char *end = p + len;
+	while(p < end) {
+		int from, to;
+		if (end - p < 3 || (from = ev_day(p)) < 0) return 0;
+		p += 3;
+		to = from;
+		if (p < end && *p == '-') {
+			if (end - p < 4 || (to = ev_day(p + 1)) < 0) return 0;
+			p += 4;
+		}
+		for(int d = from; ; d = (d + 1) % 7) {
+			days |= 1 << d;
+			if (d == to) break;
+		}
+		if (p < end && *p++ != ',') return 0;
+	}
+	return days;
+}
+
+// HH:MM[:SS]. Returns the end of it, or NULL.
+static inline const char *ev_parse_time(const char *p, int *out) {
+	int h, m, s = 0, n;
+	if (sscanf(p, "%2d:%2d%n", &h, &m, &n) != 2) return NULL;
+	p += n;
+	if (*p == ':') {
+		if (sscanf(p + 1, "%2d%n", &s, &n) != 1) return NULL;
+		p += n + 1;
+	}
+	if (h < 0 || h > 23 || m < 0 || m > 59 || s < 0 || s > 59) return NULL;
+	*out = h * 3600 + m * 60 + s;
+	return p;
+}
+
+// One line. Returns 1 for an event, 0 for a blank line or comment, and -1
+// if it's no good.
+static inline int ev_parse_line(const char *line, struct event *e) {
+	const char *p = line + strspn(line, " \t");
+	if (*p == 0 || *p == '\n' || *p == '#') return 0;
+	memset(e, 0, sizeof(*e));
+	int y, mon, d, n;
+	if (sscanf(p, "%4d-%2d-%2d%n", &y, &mon, &d, &n) == 3) {
+		p += n + strspn(p + n, " \t");
+		struct tm t;
+		memset(&t, 0, sizeof(t));
+		int when;
+		if ((p = ev_parse_time(p, &when)) == NULL) return -1;
+		t.tm_year = y - 1900;
+		t.tm_mon = mon - 1;
+		t.tm_mday = d;
+		t.tm_sec = when;
+		t.tm_isdst = -1;
+		e->once = (long long)mktime(&t);
+		if (e->once <= 0) return -1;
+	} else {
+		if ((p = ev_parse_time(p, &e->when)) == NULL) return -1;
+		p += strspn(p, " \t");
+		size_t len = strcspn(p, " \t\n");
+		e->days = ev_parse_days(p, len);
+		if (e->days) p += len;
+		else e->days = EV_ALL_DAYS;
+	}
+	p += strspn(p, " \t");
+	size_t len = strcspn(p, " \t\n");
+	const char *arg = p + len + strspn(p + len, " \t");
+	if (len == 5 && !strncmp(p, "blink", 5)) {
+		e->effect = EV_BLINK;
+		e->arg = (*arg && *arg != '\n')?atoi(arg):EV_BLINK_DEFAULT;
+		if (e->arg <= 0) return -1;
+	} else if (len == 4 && !strncmp(p, "text", 4)) {
+		e->effect = EV_TEXT;
+		snprintf(e->text, sizeof(e->text), "%.*s", (int)strcspn(arg, "\n"), arg);
+	} else if (len == 6 && !strncmp(p, "bright", 6)) {
+		e->effect = EV_BRIGHT;
+		char *end;
+		e->arg = (int)strtol(arg, &end, 10);
+		if (end == arg || e->arg < 0 || e->arg > 15) return -1;
+	} else {
+		return -1;
+	}
+	return 1;
+}
+
+// Read the file into the table the display thread isn't using, and
+// publish it. Returns how many events, or -1 (and the line it didn't like
+// in *bad, if there was one).
+static inline int ev_load(const char *path, int *bad) {
+	*bad = 0;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+	fstat(fileno(f), &ev_stat);
+	struct ev_table *t = (ev_published == &ev_slots[0])?&ev_slots[1]:&ev_slots[0];
+	t->count = 0;
+	char line[256];
+	int lineno = 0;
+	while(fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		struct event e;
+		int r = ev_parse_line(line, &e);
+		if (r < 0 || (r > 0 && t->count == EVENT_MAX)) {
+			*bad = lineno;
+			fclose(f);
+			return -1;
+		}
+		if (r > 0) t->ev[t->count++] = e;
+	}
+	fclose(f);
+	__atomic_store_n(&ev_published, t, __ATOMIC_RELEASE);
+	return t->count;
+}
+
+// For the housekeeping: if the file has changed (and the display thread
+// has taken the last one), read it again. A bad file leaves things as
+// they were. Returns 1 if it was read.
+static inline int ev_check(const char *path) {
+	struct stat st;
+	if (__atomic_load_n(&ev_adopted, __ATOMIC_ACQUIRE) != ev_published) return 0;
+	if (stat(path, &st)) return 0;
+	if (st.st_mtime == ev_stat.st_mtime && st.st_size == ev_stat.st_size && st.st_ino == ev_stat.st_ino) return 0;
+	int bad;
+	if (ev_load(path, &bad) < 0) {
+		ev_stat = st; // don't keep trying until it's changed again
+		if (bad) fprintf(stderr, "%s: line %d is no good\n", path, bad);
+		return 0;
+	}
+	return 1;
+}
+
+// When e next happens after t (POSIX ns), or 0 if it never will.
+static inline long long ev_next_after(const struct event *e, long long t) {
+	if (e->once) return (e->once * EV_SECOND_IN_NANOS > t)?e->once * EV_SECOND_IN_NANOS:0;
+	time_t sec = (time_t)(t / EV_SECOND_IN_NANOS);
+	struct tm lt;
+	localtime_r(&sec, &lt);
+	// Today, or one of the next seven days. mktime() sorts out the
+	// month ends, and daylight saving.
+	for(int d = 0; d <= 7; d++) {
+		if (!(e->days & (1 << ((lt.tm_wday + d) % 7)))) continue;
+		struct tm c = lt;
+		c.tm_mday += d;
+		c.tm_hour = 0;
+		c.tm_min = 0;
+		c.tm_sec = e->when;
+		c.tm_isdst = -1;
+		long long at = (long long)mktime(&c) * EV_SECOND_IN_NANOS;
+		if (at > t) return at;
+	}
+	return 0;
+}
+
+static inline int ev_before(int a, int b) {
+	return ev_live[a].at < ev_live[b].at;
+}
+
+static inline void ev_sift_down(int i) {
+	while(1) {
+		int l = 2 * i + 1, r = l + 1, m = i;
+		if (l < ev_count && ev_before(ev_heap[l], ev_heap[m])) m = l;
+		if (r < ev_count && ev_before(ev_heap[r], ev_heap[m])) m = r;
+		if (m == i) return;
+		int tmp = ev_heap[i];
+		ev_heap[i] = ev_heap[m];
+		ev_heap[m] = tmp;
+		i = m;
+	}
+}
+
+// When the one on top is due (POSIX ns), or 0 if there's nothing to come.
+static inline long long ev_top() {
+	return ev_count?ev_live[ev_heap[0]].at:0;
+}
+
+// Take the published table, as of t (POSIX ns). Events that were here
+// before keep when they're next due. For the display thread.
+static inline void ev_adopt(long long t) {
+	struct ev_table *table = __atomic_load_n(&ev_published, __ATOMIC_ACQUIRE);
+	static struct ev_live old[EVENT_MAX];
+	int old_count = ev_count;
+	for(int i = 0; i < old_count; i++) old[i] = ev_live[ev_heap[i]];
+	ev_count = 0;
+	for(int i = 0; i < table->count; i++) {
+		const struct event *e = &table->ev[i];
+		long long at = -1;
+		for(int j = 0; j < old_count; j++) {
+			if (old[j].at && !memcmp(&old[j].e, e, sizeof(*e))) {
+				at = old[j].at;
+				old[j].at = 0; // a duplicate line gets its own
+				break;
+			}
+		}
+		if (at < 0) at = ev_next_after(e, t);
+		if (at == 0) continue; // a one-off that's been and gone
+		ev_live[ev_count].at = at;
+		ev_live[ev_count].e = *e;
+		ev_heap[ev_count] = ev_count;
+		ev_count++;
+	}
+	for(int i = ev_count / 2 - 1; i >= 0; i--) ev_sift_down(i);
+	__atomic_store_n(&ev_adopted, table, __ATOMIC_RELEASE);
+}
+
+// The event on top has gone off at t (POSIX ns). Put it back down the heap
+// for next time, or drop it.
+static inline void ev_done(long long t) {
+	int top = ev_heap[0];
+	ev_live[top].at = ev_next_after(&ev_live[top].e, t);
+	if (ev_live[top].at == 0) ev_heap[0] = ev_heap[--ev_count];
+	ev_sift_down(0);
+}
+
+#endif
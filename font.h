@@ -0,0 +1,135 @@
+/*
+
+Seven segment glyphs for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The MAX6951's code B font only has digits and a few letters. With decoding
+off, each digit register is just the segments, so anything seven segments
+can manage is fair game. This is a font of those, for words on the display:
+"SYNC", "Err", "ALAr" and the like. Letters come out upper or lower case,
+whichever can be told apart from everything else (b, d, n, r, t...), and a
+few can't really be done (K, M, W, X) and are as near as it gets.
+
+*/
+
+#ifndef FONT_H
+#define FONT_H
+
+#ifndef _BV
+#define _BV(n) (1 << n)
+#endif
+
+// When decoding is turned off, this is the bit mapping.
+// Segment A is at the top, the rest proceed clockwise around, and
+// G is in the middle. DP is the decimal point.
+// When decoding is turned on, bits 0-3 are a hex value, 4-6 are ignored,
+// and DP is as before.
+#define MASK_DP _BV(7)
+#define MASK_A _BV(6)
+#define MASK_B _BV(5)
+#define MASK_C _BV(4)
+#define MASK_D _BV(3)
+#define MASK_E _BV(2)
+#define MASK_F _BV(1)
+#define MASK_G _BV(0)
+
+#define GLYPH_0 (MASK_A | MASK_B | MASK_C | MASK_D | MASK_E | MASK_F)
+#define GLYPH_1 (MASK_B | MASK_C)
+#define GLYPH_2 (MASK_A | MASK_B | MASK_D | MASK_E | MASK_G)
+#define GLYPH_3 (MASK_A | MASK_B | MASK_C | MASK_D | MASK_G)
+#define GLYPH_4 (MASK_B | MASK_C | MASK_F | MASK_G)
+#define GLYPH_5 (MASK_A | MASK_C | MASK_D | MASK_F | MASK_G)
+#define GLYPH_6 (MASK_A | MASK_C | MASK_D | MASK_E | MASK_F | MASK_G)
+#define GLYPH_7 (MASK_A | MASK_B | MASK_C)
+#define GLYPH_8 (MASK_A | MASK_B | MASK_C | MASK_D | MASK_E | MASK_F | MASK_G)
+#define GLYPH_9 (MASK_A | MASK_B | MASK_C | MASK_D | MASK_F | MASK_G)
+
+#define GLYPH_A (MASK_A | MASK_B | MASK_C | MASK_E | MASK_F | MASK_G)
+#define GLYPH_b (MASK_C | MASK_D | MASK_E | MASK_F | MASK_G)
+#define GLYPH_C (MASK_A | MASK_D | MASK_E | MASK_F)
+#define GLYPH_c (MASK_D | MASK_E | MASK_G)
+#define GLYPH_d (MASK_B | MASK_C | MASK_D | MASK_E | MASK_G)
+#define GLYPH_E (MASK_A | MASK_D | MASK_E | MASK_F | MASK_G)
+#define GLYPH_F (MASK_A | MASK_E | MASK_F | MASK_G)
+#define GLYPH_G (MASK_A | MASK_C | MASK_D | MASK_E | MASK_F)
+#define GLYPH_H (MASK_B | MASK_C | MASK_E | MASK_F | MASK_G)
+#define GLYPH_h (MASK_C | MASK_E | MASK_F | MASK_G)
+#define GLYPH_I (MASK_E | MASK_F)
+#define GLYPH_i (MASK_C)
+#define GLYPH_J (MASK_B | MASK_C | MASK_D | MASK_E)
+#define GLYPH_K (MASK_A | MASK_C | MASK_E | MASK_F | MASK_G)
+#define GLYPH_L (MASK_D | MASK_E | MASK_F)
+#define GLYPH_M (MASK_A | MASK_B | MASK_C | MASK_E | MASK_F)
+#define GLYPH_n (MASK_C | MASK_E | MASK_G)
+#define GLYPH_O GLYPH_0
+#define GLYPH_o (MASK_C | MASK_D | MASK_E | MASK_G)
+#define GLYPH_P (MASK_A | MASK_B | MASK_E | MASK_F | MASK_G)
+#define GLYPH_q (MASK_A | MASK_B | MASK_C | MASK_F | MASK_G)
+#define GLYPH_r (MASK_E | MASK_G)
+#define GLYPH_S GLYPH_5
+#define GLYPH_t (MASK_D | MASK_E | MASK_F | MASK_G)
+#define GLYPH_U (MASK_B | MASK_C | MASK_D | MASK_E | MASK_F)
+#define GLYPH_u (MASK_C | MASK_D | MASK_E)
+#define GLYPH_W (MASK_B | MASK_D | MASK_F | MASK_G)
+#define GLYPH_X GLYPH_H
+#define GLYPH_y (MASK_B | MASK_C | MASK_D | MASK_F | MASK_G)
+#define GLYPH_Z GLYPH_2
+
+// Indexed by ASCII. Anything else is blank.
+static const unsigned char glyph_font[128] = {
+	['0'] = GLYPH_0, ['1'] = GLYPH_1, ['2'] = GLYPH_2, ['3'] = GLYPH_3, ['4'] = GLYPH_4,
+	['5'] = GLYPH_5, ['6'] = GLYPH_6, ['7'] = GLYPH_7, ['8'] = GLYPH_8, ['9'] = GLYPH_9,
+	['A'] = GLYPH_A, ['B'] = GLYPH_b, ['C'] = GLYPH_C, ['D'] = GLYPH_d, ['E'] = GLYPH_E,
+	['F'] = GLYPH_F, ['G'] = GLYPH_G, ['H'] = GLYPH_H, ['I'] = GLYPH_I, ['J'] = GLYPH_J,
+	['K'] = GLYPH_K, ['L'] = GLYPH_L, ['M'] = GLYPH_M, ['N'] = GLYPH_n, ['O'] = GLYPH_O,
+	['P'] = GLYPH_P, ['Q'] = GLYPH_q, ['R'] = GLYPH_r, ['S'] = GLYPH_S, ['T'] = GLYPH_t,
+	['U'] = GLYPH_U, ['V'] = GLYPH_U, ['W'] = GLYPH_W, ['X'] = GLYPH_X, ['Y'] = GLYPH_y,
+	['Z'] = GLYPH_Z,
+	['a'] = GLYPH_A, ['b'] = GLYPH_b, ['c'] = GLYPH_c, ['d'] = GLYPH_d, ['e'] = GLYPH_E,
+	['f'] = GLYPH_F, ['g'] = GLYPH_G, ['h'] = GLYPH_h, ['i'] = GLYPH_i, ['j'] = GLYPH_J,
+	['k'] = GLYPH_K, ['l'] = GLYPH_L, ['m'] = GLYPH_M, ['n'] = GLYPH_n, ['o'] = GLYPH_o,
+	['p'] = GLYPH_P, ['q'] = GLYPH_q, ['r'] = GLYPH_r, ['s'] = GLYPH_S, ['t'] = GLYPH_t,
+	['u'] = GLYPH_u, ['v'] = GLYPH_u, ['w'] = GLYPH_W, ['x'] = GLYPH_X, ['y'] = GLYPH_y,
+	['z'] = GLYPH_Z,
+	['-'] = MASK_G, ['_'] = MASK_D, ['='] = MASK_D | MASK_G, ['\''] = MASK_F, ['"'] = MASK_B | MASK_F,
+	['['] = GLYPH_C, ['('] = GLYPH_C, [']'] = MASK_A | MASK_B | MASK_C | MASK_D, [')'] = MASK_A | MASK_B | MASK_C | MASK_D,
+	['?'] = MASK_A | MASK_B | MASK_E | MASK_G, ['/'] = MASK_B | MASK_E | MASK_G, ['*'] = MASK_A | MASK_B | MASK_F | MASK_G,
+};
+
+// What the chip's code B font draws, for a digit that has to be taken off
+// decoding to have something else drawn over it.
+static const unsigned char glyph_codeb[16] = {
+	GLYPH_0, GLYPH_1, GLYPH_2, GLYPH_3, GLYPH_4, GLYPH_5, GLYPH_6, GLYPH_7,
+	GLYPH_8, GLYPH_9, MASK_G, GLYPH_E, GLYPH_H, GLYPH_L, GLYPH_P, 0
+};
+
+// Turn text into at most max glyphs. A '.' goes on the decimal point of
+// the glyph before it, if it can. Returns how many.
+static inline int glyph_text(const char *text, unsigned char *out, int max) {
+	int n = 0;
+	for(const unsigned char *p = (const unsigned char *)text; *p && n < max; p++) {
+		if (*p == '.' && n > 0 && !(out[n - 1] & MASK_DP)) {
+			out[n - 1] |= MASK_DP;
+			continue;
+		}
+		out[n++] = (*p == '.')?MASK_DP:(*p < 128)?glyph_font[*p]:0;
+	}
+	return n;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Golden frame check for the SPI Clock. Runs each -V case in golden/cases
+# and compares every frame with the one kept in golden/<name>.out.
+#
+# golden/check.sh [clock binary] - compare (default ./clock)
+# golden/check.sh -u [clock binary] - keep the new output as the golden
+#
+# Run it from the top of the tree. It needs the time zone files, but no
+# hardware or privileges.
+
+update=0
+if [ "$1" = "-u" ]; then
+	update=1
+	shift
+fi
+clock=${1:-./clock}
+dir=$(dirname "$0")
+tmp=$(mktemp)
+trap 'rm -f "$tmp"' EXIT
+
+failed=0
+grep -v '^#' "$dir/cases" | grep -v '^$' | while IFS='|' read -r name zone when opts; do
+	# $opts is split into words on purpose.
+	if ! TZ=$zone "$clock" $opts -V "$when" > "$tmp" 2> /dev/null; then
+		echo "$name: the clock failed"
+		exit 1
+	fi
+	if [ $update = 1 ]; then
+		cp "$tmp" "$dir/$name.out"
+	elif ! diff -u "$dir/$name.out" "$tmp" > /dev/null; then
+		echo "$name: differs"
+		diff -u "$dir/$name.out" "$tmp" | head -20
+		exit 1
+	fi
+done || failed=1
+
+if [ $failed = 1 ]; then
+	echo "FAILED"
+	exit 1
+fi
+[ $update = 1 ] && echo "updated" || echo "ok"
@@ -0,0 +1,207 @@
+/*
+
+Leap seconds for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+CLOCK_REALTIME can't show a leap second: the kernel shows 23:59:59 twice
+(or the NTP server smears the second over a day, and everything runs slow).
+CLOCK_TAI just keeps going. So with a leap mode, the display thread runs on
+CLOCK_TAI, and works out what to show from that:
+
+tai - a true 23:59:60 during an inserted second.
+smear - the second spread evenly over a window (24 hours by default)
+centered on the leap, the way Google's and Amazon's NTP servers do it.
+
+CLOCK_TAI is CLOCK_REALTIME plus the offset the kernel keeps (ntpd or
+chrony set it). The kernel also knows about a leap for the end of the day,
+once NTP has announced one. Failing that, the next one comes from a copy of
+leap-seconds.list, if there is one (it's usually in /usr/share/zoneinfo).
+None of that is asked for on a tick. The housekeeping looks once a minute,
+and only if something has changed does it publish a new leap_info for the
+display thread. That's a pointer swap between two copies, so the display
+thread never sees half of one.
+
+*/
+
+#ifndef LEAP_H
+#define LEAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timex.h>
+
+#define LEAP_NONE 0
+#define LEAP_TAI 1
+#define LEAP_SMEAR 2
+
+#define LEAP_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+#define LEAP_DAY_IN_NANOS (24LL * 60 * 60 * LEAP_SECOND_IN_NANOS)
+// leap-seconds.list counts from 1900
+#define LEAP_NTP_EPOCH 2208988800LL
+#define LEAP_MAX 64
+// Smeared tick boundaries land this far past the boundary, as with the
+// sidereal ones.
+#define LEAP_NUDGE 1000LL
+
+static volatile unsigned char leap_mode = LEAP_NONE;
+static long long leap_smear = 24 * 60 * 60 * LEAP_SECOND_IN_NANOS; // the smear window
+
+// leap-seconds.list: from the POSIX second at[i], TAI - UTC is offset[i].
+static long long leap_table_at[LEAP_MAX];
+static int leap_table_offset[LEAP_MAX];
+static int leap_table_count = 0;
+
+struct leap_info {
+	long long offset; // CLOCK_TAI - CLOCK_REALTIME until the leap, ns
+	long long at; // the midnight (POSIX ns) the leap comes before, or 0 for none
+	int delta; // 1 for a second inserted, -1 for one taken out
+};
+
+static struct leap_info leap_slots[2];
+static struct leap_info *volatile leap_now = &leap_slots[0];
+
+// Load a leap-seconds.list file. Returns the number of entries, or -1.
+static inline int leap_load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+	char line[256];
+	leap_table_count = 0;
+	while(fgets(line, sizeof(line), f) != NULL && leap_table_count < LEAP_MAX) {
+		long long ntp;
+		int offset;
+		if (line[0] == '#' || sscanf(line, "%lld %d", &ntp, &offset) != 2) continue;
+		leap_table_at[leap_table_count] = ntp - LEAP_NTP_EPOCH;
+		leap_table_offset[leap_table_count] = offset;
+		leap_table_count++;
+	}
+	fclose(f);
+	return leap_table_count?leap_table_count:-1;
+}
+
+// Work out what's coming as of now (POSIX ns), and publish it if it's
+// changed. With kernel set, the offset (and any leap it's been told of)
+// comes from the kernel. Otherwise (for a simulation), from the file.
+// Returns 1 if it changed.
+static inline int leap_refresh(long long now, int kernel) {
+	struct leap_info li = { 0, 0, 0 };
+	if (kernel) {
+		struct timex tx;
+		memset(&tx, 0, sizeof(tx));
+		int state = adjtimex(&tx);
+		long long midnight = (now / LEAP_DAY_IN_NANOS + 1) * LEAP_DAY_IN_NANOS;
+		li.offset = tx.tai * LEAP_SECOND_IN_NANOS;
+		switch(state) {
+			case TIME_INS:
+				li.at = midnight;
+				li.delta = 1;
+				break;
+			case TIME_DEL:
+				li.at = midnight;
+				li.delta = -1;
+				break;
+			case TIME_OOP:
+				// In the middle of it. The kernel has already
+				// moved the offset on.
+				li.offset -= LEAP_SECOND_IN_NANOS;
+				li.at = midnight;
+				li.delta = 1;
+				break;
+		}
+	}
+	if (li.at == 0) {
+		// The next one, or one whose smear we're still in the middle of.
+		long long margin = (leap_mode == LEAP_SMEAR)?leap_smear / 2 + LEAP_SECOND_IN_NANOS:0;
+		for(int i = 0; i < leap_table_count; i++) {
+			long long at = leap_table_at[i] * LEAP_SECOND_IN_NANOS;
+			if (at + margin <= now) {
+				if (!kernel) li.offset = leap_table_offset[i] * LEAP_SECOND_IN_NANOS;
+				continue;
+			}
+			// The first entry is where the count starts, not a leap.
+			if (i > 0) {
+				li.at = at;
+				li.delta = leap_table_offset[i] - leap_table_offset[i - 1];
+				// The kernel has already been through it.
+				if (kernel && at <= now) li.offset -= li.delta * LEAP_SECOND_IN_NANOS;
+			}
+			break;
+		}
+	}
+	struct leap_info *cur = leap_now;
+	if (!memcmp(cur, &li, sizeof(li))) return 0;
+	// The display thread only holds on to it for a tick, and this is once
+	// a minute at most, so the spare copy is never still in use.
+	struct leap_info *spare = (cur == &leap_slots[0])?&leap_slots[1]:&leap_slots[0];
+	*spare = li;
+	__atomic_store_n(&leap_now, spare, __ATOMIC_RELEASE);
+	return 1;
+}
+
+// What to show at the instant t (CLOCK_TAI ns), as POSIX ns. During an
+// inserted second, *in_leap is set and the result is back in second 59,
+// which the display shows as 60.
+static inline long long leap_posix(long long t, int *in_leap) {
+	const struct leap_info *li = __atomic_load_n(&leap_now, __ATOMIC_ACQUIRE);
+	long long utc = t - li->offset;
+	*in_leap = 0;
+	if (li->at == 0) return utc;
+	long long delta = li->delta * LEAP_SECOND_IN_NANOS;
+	if (leap_mode == LEAP_SMEAR) {
+		// The window is a second longer (or shorter) in TAI than on
+		// the display, and the display goes that much slower.
+		long long start = li->at - leap_smear / 2;
+		if (utc <= start) return utc;
+		if (utc >= start + leap_smear + delta) return utc - delta;
+		return start + (long long)((long double)(utc - start) * leap_smear / (leap_smear + delta));
+	}
+	if (utc < li->at - ((delta < 0)?LEAP_SECOND_IN_NANOS:0)) return utc;
+	if (delta > 0 && utc < li->at + LEAP_SECOND_IN_NANOS) {
+		*in_leap = 1;
+		return utc - LEAP_SECOND_IN_NANOS;
+	}
+	return utc - delta;
+}
+
+// The other way: the CLOCK_TAI instant at which the display gets to d.
+// Nothing maps into an inserted second, so the instant after 23:59:59.9
+// is midnight.
+static inline long long leap_tai(long long d) {
+	const struct leap_info *li = __atomic_load_n(&leap_now, __ATOMIC_ACQUIRE);
+	if (li->at == 0) return d + li->offset;
+	long long delta = li->delta * LEAP_SECOND_IN_NANOS;
+	if (leap_mode == LEAP_SMEAR) {
+		long long start = li->at - leap_smear / 2;
+		if (d <= start) return d + li->offset;
+		if (d >= start + leap_smear) return d + delta + li->offset;
+		return start + (long long)((long double)(d - start) * (leap_smear + delta) / leap_smear) + LEAP_NUDGE + li->offset;
+	}
+	return ((d < li->at)?d:d + delta) + li->offset;
+}
+
+// Leaving out the 23:59:60, for the things that go by the calendar.
+static inline long long leap_to_posix(long long t) {
+	int in_leap;
+	return leap_mode?leap_posix(t, &in_leap):t;
+}
+
+static inline long long leap_from_posix(long long d) {
+	return leap_mode?leap_tai(d):d;
+}
+
+#endif
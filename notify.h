@@ -0,0 +1,83 @@
+/*
+
+systemd notification for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+Run as a Type=notify service, systemd puts the name of a Unix datagram
+socket in NOTIFY_SOCKET, and wants to hear READY=1 on it once we're up.
+With WatchdogSec= set, it also puts the interval (usec) in WATCHDOG_USEC,
+and restarts us if WATCHDOG=1 doesn't come at least that often. That's
+all sd_notify() does, so there's no need for libsystemd to do it.
+
+A name starting with @ is in the abstract namespace, which has a NUL
+there instead. Without NOTIFY_SOCKET, none of this does anything.
+
+To try it without systemd, listen on a socket of your own:
+
+socat -u UNIX-RECV:/tmp/notify -
+NOTIFY_SOCKET=/tmp/notify WATCHDOG_USEC=10000000 spiclock -d
+
+*/
+
+#ifndef NOTIFY_H
+#define NOTIFY_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addr_len;
+static long long notify_watchdog = 0; // usec, or 0 for no watchdog
+
+// After daemon(), if any: the watchdog is for whoever systemd started,
+// and WATCHDOG_PID says who that is. Returns 0 on success, which includes
+// there being nothing to notify.
+static inline int notify_open() {
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (path == NULL || *path == 0) return 0;
+	size_t len = strlen(path);
+	if ((*path != '/' && *path != '@') || len >= sizeof(notify_addr.sun_path)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&notify_addr, 0, sizeof(notify_addr));
+	notify_addr.sun_family = AF_UNIX;
+	memcpy(notify_addr.sun_path, path, len);
+	if (*path == '@') notify_addr.sun_path[0] = 0;
+	notify_addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+	notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (notify_fd < 0) return -1;
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid = getenv("WATCHDOG_PID");
+	if (usec != NULL && (pid == NULL || atol(pid) == (long)getpid())) notify_watchdog = atoll(usec);
+	return 0;
+}
+
+// One message, like "READY=1". Safe in a signal handler.
+static inline void notify_send(const char *msg) {
+	if (notify_fd < 0) return;
+	sendto(notify_fd, msg, strlen(msg), MSG_NOSIGNAL, (const struct sockaddr *)&notify_addr, notify_addr_len);
+}
+
+#endif
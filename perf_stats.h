@@ -0,0 +1,179 @@
+/*
+
+Performance counters for the SPI Clock's tick handler
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+This counts what the display thread does during each stage of a tick with
+perf_event_open(): cycles, instructions, cache misses, context switches and
+page faults, plus the elapsed time. The counters are opened as one group on
+the display thread, and read once at each stage boundary, so every stage
+costs a read() - this is for finding out where the time goes, not for
+leaving on.
+
+Not every Pi kernel has a PMU driver (and VMs usually don't either), so any
+counter that won't open is just left out.
+
+*/
+
+#ifndef PERF_STATS_H
+#define PERF_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "trace.h"
+
+// The stages of a tick
+#define STAGE_TIME 0 // reading the clock and picking the tick
+#define STAGE_CALENDAR 1 // turning the tick into hours, minutes and seconds
+#define STAGE_ENCODE 2 // building the frame
+#define STAGE_COMMIT 3 // sending it
+#define STAGE_STAGED 4 // with -F, sending the next digits to the hidden plane early
+#define STAGE_WAIT 5 // and then waiting for the tick
+#define STAGE_COUNT 6
+
+// The counters. PERF_ELAPSED isn't a perf counter, it's trace_clock().
+#define PERF_CYCLES 0
+#define PERF_INSTRUCTIONS 1
+#define PERF_CACHE_MISSES 2
+#define PERF_CONTEXT_SWITCHES 3
+#define PERF_PAGE_FAULTS 4
+#define PERF_ELAPSED 5
+#define PERF_COUNT 6
+
+static const char *perf_stage_names[STAGE_COUNT] = { "time", "calendar", "encode", "commit", "staged",
+	"wait" };
+static const char *perf_counter_names[PERF_COUNT] = { "cycles", "instructions", "cache-misses",
+	"context-switches", "page-faults", "usec" };
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_ELAPSED] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+struct perf_stage {
+	uint64_t samples;
+	uint64_t sum[PERF_COUNT];
+	uint64_t max[PERF_COUNT];
+};
+
+static int perf_group = -1; // the group leader
+static int perf_slot[PERF_ELAPSED]; // where each counter lands in a group read, or -1
+static int perf_nr = 0; // how many counters are in the group
+static uint64_t perf_last[PERF_COUNT];
+static struct perf_stage perf_stages[STAGE_COUNT];
+// This tick's, so far, and which stages it's been through
+static uint64_t perf_tick[STAGE_COUNT][PERF_COUNT];
+static unsigned int perf_seen = 0;
+
+static inline int perf_read(uint64_t *now) {
+	// PERF_FORMAT_GROUP: the number of counters, then each value.
+	uint64_t buf[1 + PERF_ELAPSED];
+	if (read(perf_group, buf, sizeof(buf)) < (ssize_t)((1 + perf_nr) * sizeof(uint64_t))) return -1;
+	for(int i = 0; i < PERF_ELAPSED; i++) {
+		now[i] = (perf_slot[i] >= 0)?buf[1 + perf_slot[i]]:0;
+	}
+	now[PERF_ELAPSED] = trace_clock();
+	return 0;
+}
+
+// Open the counters on the calling thread. Returns the number of counters
+// that could be opened.
+static inline int perf_open() {
+	for(int i = 0; i < PERF_ELAPSED; i++) {
+		perf_slot[i] = -1;
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = (perf_group < 0); // the leader starts the whole group
+		attr.exclude_hv = 1;
+		int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, perf_group, 0);
+		if (fd < 0) continue;
+		if (perf_group < 0) perf_group = fd;
+		perf_slot[i] = perf_nr++;
+	}
+	if (perf_group < 0) return 0;
+	if (ioctl(perf_group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) || perf_read(perf_last)) {
+		close(perf_group);
+		perf_group = -1;
+		return 0;
+	}
+	return perf_nr;
+}
+
+// Close out a stage: everything counted since the last call is charged to it.
+// A stage can come up more than once in a tick (with -F, the encoding goes
+// on after the wait), and that's still one sample.
+static inline void perf_mark(int stage) {
+	if (perf_group < 0) return;
+	uint64_t now[PERF_COUNT];
+	if (perf_read(now)) return;
+	struct perf_stage *s = &perf_stages[stage];
+	if (!(perf_seen & (1U << stage))) {
+		perf_seen |= 1U << stage;
+		memset(perf_tick[stage], 0, sizeof(perf_tick[stage]));
+		s->samples++;
+	}
+	for(int i = 0; i < PERF_COUNT; i++) {
+		uint64_t delta = (i == PERF_ELAPSED)?(uint32_t)(now[i] - perf_last[i]):now[i] - perf_last[i];
+		s->sum[i] += delta;
+		perf_tick[stage][i] += delta;
+		if (perf_tick[stage][i] > s->max[i]) s->max[i] = perf_tick[stage][i];
+		perf_last[i] = now[i];
+	}
+}
+
+// Start a new tick. Whatever was counted since the last stage (mostly
+// sleeping) is dropped.
+static inline void perf_start() {
+	if (perf_group < 0) return;
+	perf_seen = 0;
+	perf_read(perf_last);
+}
+
+// Mean and max of every counter for every stage. These are read from
+// another thread without any locking, so they're only approximately
+// consistent with each other.
+static inline void perf_write_stats(FILE *f) {
+	if (perf_group < 0) return;
+	for(int s = 0; s < STAGE_COUNT; s++) {
+		uint64_t n = perf_stages[s].samples;
+		if (n == 0) continue;
+		for(int i = 0; i < PERF_COUNT; i++) {
+			if (i < PERF_ELAPSED && perf_slot[i] < 0) continue;
+			fprintf(f, "perf %s %s %.1f %llu\n", perf_stage_names[s], perf_counter_names[i],
+				(double)perf_stages[s].sum[i] / n, (unsigned long long)perf_stages[s].max[i]);
+		}
+	}
+}
+
+#endif
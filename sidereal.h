@@ -0,0 +1,385 @@
+/*
+
+Sidereal time for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+There are two ways of working out mean sidereal time here.
+
+The first is the USNO's low precision formula. It's good to about a tenth of
+a second over a century or so, except that it's a function of UT1, and we
+feed it UTC, which can be as much as 0.9 seconds off.
+
+The second is the IAU 2006 GMST, which is the Earth Rotation Angle (a
+linear function of UT1) plus a polynomial in TT. UT1 - UTC (DUT1) comes
+from a local copy of one of the IERS's finals files (finals2000A.data,
+finals.daily and so on). The functions are the same as the SOFA library's
+iauEra00() and iauGmst06(), and SPI_Sidereal_Check.c checks them against
+the SOFA test values.
+
+Doing all of that in double precision for every tick would be expensive on
+a Pi Zero. But over a single UTC day, DUT1 is interpolated linearly between
+the IERS's daily values, and the TT polynomial is as good as linear, so
+sidereal time is a linear function of UTC. So once a day we work out
+where the day starts and how fast it goes, in fixed point, and every tick
+in between is a couple of integer multiplies.
+
+Apparent sidereal time is mean sidereal time plus the equation of the
+equinoxes, which is mostly the nutation in longitude. That's a long series
+of sines (106 terms for IAU 1980), so this uses just the biggest terms of
+it, and works it out at most once a minute, because nothing in it changes
+fast enough to matter in less. Each tick just adds the cached value.
+SPI_Sidereal_Check.c shows what dropping more or fewer terms costs.
+
+Nothing here needs libm, so there are small sin() and cos() here too.
+
+*/
+
+#ifndef SIDEREAL_H
+#define SIDEREAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SR_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+#define SR_DAY_IN_NANOS (86400LL * SR_SECOND_IN_NANOS)
+
+// These two values are the same, one in C time, the other a Julian date
+// Both represent 1/1/2000 00:00 UTC.
+#define EPOCH_CTIME (946684800L)
+#define EPOCH_JDATE (2451544.5)
+
+// Sidereal seconds per mean solar second
+#define SIDEREAL_RATE 1.00273790935L
+
+#define SR_2PI 6.283185307179586476925287
+#define SR_DAS2R 4.848136811095359935899141e-6 // arcseconds to radians
+#define SR_DJ00 2451545.0 // J2000.0
+#define SR_DJC 36525.0 // days per Julian century
+#define SR_DJM0 2400000.5 // MJD zero point
+#define SR_MJD_EPOCH 40587 // MJD of 1970-01-01
+
+// TT - UTC, in seconds: TAI - UTC (37 seconds since the start of 2017),
+// plus TT - TAI. It only shows up in the slowly varying part of GMST, so a
+// leap second or two out of date doesn't matter.
+#define SR_TT_MINUS_UTC (37.0 + 32.184)
+
+// Fixed point sidereal time is in 2^-16 ns.
+#define SR_FP_SHIFT 16
+#define SR_DAY_FP ((uint64_t)SR_DAY_IN_NANOS << SR_FP_SHIFT)
+
+// Degrees east (negative for west)
+static volatile float longitude = 0.0;
+// Apparent rather than mean sidereal time
+static volatile unsigned char apparent = 0;
+
+// Local mean sidereal time at the instant t (nanoseconds since the epoch),
+// in nanoseconds since sidereal midnight, by the USNO formula.
+static inline long long sidereal_nanos(long long t) {
+	// turn the instant into an absolute fraction.
+	long double now = (t / SR_SECOND_IN_NANOS) + ((long double)(t % SR_SECOND_IN_NANOS)) / SR_SECOND_IN_NANOS;
+
+	long double JD = ((now - EPOCH_CTIME) / 86400.0L) + EPOCH_JDATE;
+
+	long double JD0 = (((((long)(now / 86400)) * 86400) - EPOCH_CTIME) / 86400.0) + EPOCH_JDATE;
+
+	long double D0 = JD0 - (EPOCH_JDATE + .5);
+	long double H = (JD - JD0) * 24.0;
+	long double T = (JD - (EPOCH_JDATE + .5)) / 36525.0;
+
+	long double gmst = (6.697374558L + 0.06570982441908L * D0 + SIDEREAL_RATE * H) + 0.000026 * T * T;
+	gmst += (longitude / 360.0L) * 24.0L;
+	gmst -= 24.0L * (long long)(gmst / 24.0L);
+	if (gmst < 0) gmst += 24.0L;
+	return (long long)(gmst * 3600.0L * SR_SECOND_IN_NANOS);
+}
+
+// The fractional part, with the sign of x (like fmod(x, 1.0)).
+static inline double sr_frac(double x) {
+	return x - (double)(long long)x;
+}
+
+// sin(x) by Taylor series, after folding x into -pi/2..pi/2. Good to
+// better than 1e-9, which is plenty here.
+static inline double sr_sin(double x) {
+	x -= SR_2PI * (double)(long long)(x / SR_2PI);
+	if (x > SR_2PI / 2) x -= SR_2PI;
+	if (x < -SR_2PI / 2) x += SR_2PI;
+	if (x > SR_2PI / 4) x = SR_2PI / 2 - x;
+	if (x < -SR_2PI / 4) x = -SR_2PI / 2 - x;
+	double x2 = x * x;
+	return x * (1 - x2 / 6 * (1 - x2 / 20 * (1 - x2 / 42 * (1 - x2 / 72 * (1 - x2 / 110 * (1 - x2 / 156))))));
+}
+
+static inline double sr_cos(double x) {
+	return sr_sin(x + SR_2PI / 4);
+}
+
+// Normalize an angle into 0 <= a < 2pi.
+static inline double sr_anp(double a) {
+	double w = a - SR_2PI * (double)(long long)(a / SR_2PI);
+	if (w < 0) w += SR_2PI;
+	return w;
+}
+
+// The Earth Rotation Angle, in radians, at the UT1 Julian date dj1 + dj2.
+static inline double era00(double dj1, double dj2) {
+	double d1, d2;
+	if (dj1 < dj2) {
+		d1 = dj1;
+		d2 = dj2;
+	} else {
+		d1 = dj2;
+		d2 = dj1;
+	}
+	double t = d1 + (d2 - SR_DJ00);
+	double f = sr_frac(d1) + sr_frac(d2);
+	return sr_anp(SR_2PI * (f + 0.7790572732640 + 0.00273781191135448 * t));
+}
+
+// IAU 2006 Greenwich Mean Sidereal Time, in radians, at UT1 uta + utb and
+// TT tta + ttb (both Julian dates).
+static inline double gmst06(double uta, double utb, double tta, double ttb) {
+	double t = ((tta - SR_DJ00) + ttb) / SR_DJC;
+	return sr_anp(era00(uta, utb) +
+		(    0.014506     +
+		(  4612.156534    +
+		(     1.3915817   +
+		(    -0.00000044  +
+		(    -0.000029956 +
+		(    -0.0000000368 )
+		* t) * t) * t) * t) * t) * SR_DAS2R);
+}
+
+// The IAU 1980 nutation in longitude, biggest terms first (from Meeus,
+// Astronomical Algorithms, table 22.A): the multiples of D, M, M', F and
+// Omega in the argument, and the coefficient of its sine and the rate of
+// change of that, in 0.0001" and 0.0001" per century.
+struct nut_term {
+	signed char d, m, mp, f, om;
+	float s, st;
+};
+
+#define NUT_TERMS 31
+static const struct nut_term nut_terms[NUT_TERMS] = {
+	{ 0, 0, 0, 0, 1, -171996, -174.2 },
+	{ -2, 0, 0, 2, 2, -13187, -1.6 },
+	{ 0, 0, 0, 2, 2, -2274, -0.2 },
+	{ 0, 0, 0, 0, 2, 2062, 0.2 },
+	{ 0, 1, 0, 0, 0, 1426, -3.4 },
+	{ 0, 0, 1, 0, 0, 712, 0.1 },
+	{ -2, 1, 0, 2, 2, -517, 1.2 },
+	{ 0, 0, 0, 2, 1, -386, -0.4 },
+	{ 0, 0, 1, 2, 2, -301, 0 },
+	{ -2, -1, 0, 2, 2, 217, -0.5 },
+	{ -2, 0, 1, 0, 0, -158, 0 },
+	{ -2, 0, 0, 2, 1, 129, 0.1 },
+	{ 0, 0, -1, 2, 2, 123, 0 },
+	{ 2, 0, 0, 0, 0, 63, 0 },
+	{ 0, 0, 1, 0, 1, 63, 0.1 },
+	{ 2, 0, -1, 2, 2, -59, 0 },
+	{ 0, 0, -1, 0, 1, -58, -0.1 },
+	{ 0, 0, 1, 2, 1, -51, 0 },
+	{ -2, 0, 2, 0, 0, 48, 0 },
+	{ 0, 0, -2, 2, 1, 46, 0 },
+	{ 2, 0, 0, 2, 2, -38, 0 },
+	{ 0, 0, 2, 2, 2, -31, 0 },
+	{ 0, 0, 2, 0, 0, 29, 0 },
+	{ -2, 0, 1, 2, 2, 29, 0 },
+	{ 0, 0, 0, 2, 0, 26, 0 },
+	{ -2, 0, 0, 2, 0, -22, 0 },
+	{ 0, 0, -1, 2, 1, 21, 0 },
+	{ 0, 2, 0, 0, 0, 17, -0.1 },
+	{ 2, 0, -1, 0, 1, 16, 0 },
+	{ -2, 2, 0, 2, 2, -16, 0.1 },
+	{ 0, 1, 0, 0, 1, -15, 0 },
+};
+
+// How many of them the clock uses. Past the first dozen or so, each term
+// is worth less than a millisecond of time.
+#define NUT_TERMS_USED 13
+
+// Degrees to radians, after taking out whole turns.
+static inline double sr_deg(double d) {
+	return (d - 360.0 * (double)(long long)(d / 360.0)) * (SR_2PI / 360.0);
+}
+
+// The equation of the equinoxes, in radians, at the TT Julian date
+// date1 + date2, using the first terms of the nutation series. This is
+// iauEqeq94(), but with Meeus' fundamental arguments and a shorter series.
+static inline double eqeq94(double date1, double date2, int terms) {
+	double t = ((date1 - SR_DJ00) + date2) / SR_DJC;
+	double t2 = t * t, t3 = t2 * t;
+	double d = sr_deg(297.85036 + 445267.111480 * t - 0.0019142 * t2 + t3 / 189474.0);
+	double m = sr_deg(357.52772 + 35999.050340 * t - 0.0001603 * t2 - t3 / 300000.0);
+	double mp = sr_deg(134.96298 + 477198.867398 * t + 0.0086972 * t2 + t3 / 56250.0);
+	double f = sr_deg(93.27191 + 483202.017538 * t - 0.0036825 * t2 + t3 / 327270.0);
+	double om = sr_deg(125.04452 - 1934.136261 * t + 0.0020708 * t2 + t3 / 450000.0);
+	double dpsi = 0;
+	for(int i = 0; i < terms && i < NUT_TERMS; i++) {
+		const struct nut_term *n = &nut_terms[i];
+		dpsi += (n->s + n->st * t) * sr_sin(n->d * d + n->m * m + n->mp * mp + n->f * f + n->om * om);
+	}
+	dpsi *= 0.0001 * SR_DAS2R;
+	double eps0 = (84381.448 - 46.8150 * t - 0.00059 * t2 + 0.001813 * t3) * SR_DAS2R;
+	return dpsi * sr_cos(eps0) + (0.00264 * sr_sin(om) + 0.000063 * sr_sin(2 * om)) * SR_DAS2R;
+}
+
+// The equation of the equinoxes at the instant t, in sidereal ns, cached
+// for the minute t is in.
+static long long ee_start = 0, ee_end = 0;
+static long long ee_nanos = 0;
+
+static inline long long eqeq_nanos(long long t) {
+	if (t < ee_start || t >= ee_end) {
+		long long minute = 60 * SR_SECOND_IN_NANOS;
+		ee_start = t - t % minute;
+		ee_end = ee_start + minute;
+		long long day = t / SR_DAY_IN_NANOS;
+		double frac = (double)(t - day * SR_DAY_IN_NANOS) / SR_DAY_IN_NANOS;
+		double ee = eqeq94(SR_DJM0 + SR_MJD_EPOCH + day, frac + SR_TT_MINUS_UTC / 86400.0, NUT_TERMS_USED);
+		ee_nanos = (long long)(ee / SR_2PI * SR_DAY_IN_NANOS);
+	}
+	return ee_nanos;
+}
+
+// Turn mean sidereal time (as from sidereal_nanos() or gmst06_nanos()) at
+// the instant t into apparent.
+static inline long long sidereal_apparent(long long mean, long long t) {
+	long long st = mean + eqeq_nanos(t);
+	if (st < 0) st += SR_DAY_IN_NANOS;
+	if (st >= SR_DAY_IN_NANOS) st -= SR_DAY_IN_NANOS;
+	return st;
+}
+
+// DUT1 (UT1 - UTC, in seconds) for a run of consecutive days
+static double *dut1_table = NULL;
+static int dut1_first = 0; // MJD of dut1_table[0]
+static int dut1_count = 0;
+
+// Load an IERS finals file. Returns the number of days, or -1.
+static inline int dut1_load(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+	char line[256];
+	int size = 0;
+	dut1_count = 0;
+	while(fgets(line, sizeof(line), f) != NULL) {
+		// MJD is in columns 8-15, the UT1-UTC flag (I or P) is in
+		// column 58, and UT1-UTC is in columns 59-68. Days with no
+		// value yet have a blank flag.
+		if (strlen(line) < 68 || (line[57] != 'I' && line[57] != 'P')) continue;
+		char field[16];
+		memcpy(field, line + 7, 8);
+		field[8] = 0;
+		int mjd = (int)atof(field);
+		memcpy(field, line + 58, 10);
+		field[10] = 0;
+		double dut1 = atof(field);
+		if (dut1_count == 0) {
+			dut1_first = mjd;
+		} else if (mjd != dut1_first + dut1_count) {
+			continue; // out of order or a gap. They don't do that.
+		}
+		if (dut1_count == size) {
+			size = size?size * 2:4096;
+			double *bigger = realloc(dut1_table, size * sizeof(double));
+			if (bigger == NULL) {
+				fclose(f);
+				return -1;
+			}
+			dut1_table = bigger;
+		}
+		dut1_table[dut1_count++] = dut1;
+	}
+	fclose(f);
+	return dut1_count?dut1_count:-1;
+}
+
+// DUT1 at 0h UTC on the given MJD. Beyond the ends of the table, the
+// nearest value is the best guess we have.
+static inline double dut1_at(int mjd) {
+	if (dut1_count == 0) return 0.0;
+	int i = mjd - dut1_first;
+	if (i < 0) i = 0;
+	if (i >= dut1_count) i = dut1_count - 1;
+	return dut1_table[i];
+}
+
+// GMST at 0h UTC on the given MJD, in radians.
+static inline double gmst06_mjd(int mjd, double dut1) {
+	// Keep the whole days and the fraction apart, or the fraction loses
+	// most of its bits.
+	return gmst06(SR_DJM0 + mjd, dut1 / 86400.0, SR_DJM0 + mjd, SR_TT_MINUS_UTC / 86400.0);
+}
+
+// One UTC day of sidereal time, in fixed point
+struct sr_day {
+	long long start; // 0h UTC, ns since the epoch
+	uint64_t base; // local sidereal time then
+	uint64_t per_sec; // how much it goes up per second of UTC
+	uint64_t per_ns; // and per ns, in 2^-32 ns
+};
+
+static struct sr_day sr_day = { 0, 0, 0, 0 }; // per_sec 0 until it's worked out
+
+static inline void sr_day_compute(struct sr_day *d, long long day) {
+	int mjd = SR_MJD_EPOCH + (int)day;
+	double g0 = gmst06_mjd(mjd, dut1_at(mjd));
+	double g1 = gmst06_mjd(mjd + 1, dut1_at(mjd + 1));
+	// A bit over one turn in a day.
+	double turns = sr_anp(g1 - g0) / SR_2PI + 1.0;
+	double start = (g0 / SR_2PI + longitude / 360.0) * SR_DAY_IN_NANOS;
+	start -= SR_DAY_IN_NANOS * (double)(long long)(start / SR_DAY_IN_NANOS);
+	if (start < 0) start += SR_DAY_IN_NANOS;
+	d->start = day * SR_DAY_IN_NANOS;
+	d->base = (uint64_t)(start * (1 << SR_FP_SHIFT));
+	d->per_sec = (uint64_t)(turns * SR_SECOND_IN_NANOS * (1 << SR_FP_SHIFT) + 0.5);
+	d->per_ns = (uint64_t)(turns * 4294967296.0 + 0.5);
+}
+
+// gmst06_nanos() for n instants in the day d, given as whole seconds since
+// its start. There are no branches or divides in the loop, so the compiler
+// can vectorize it. SPI_Sidereal_Check.c uses it to go over years at a time.
+static inline void sr_day_batch(const struct sr_day *d, const uint32_t *restrict sec, uint64_t *restrict out, int n) {
+	uint64_t base = d->base, per_sec = d->per_sec;
+	for(int i = 0; i < n; i++) {
+		// Less than two days' worth, so two goes at the modulus do it.
+		uint64_t st = base + sec[i] * per_sec;
+		st -= (st >= SR_DAY_FP)?SR_DAY_FP:0;
+		st -= (st >= SR_DAY_FP)?SR_DAY_FP:0;
+		out[i] = st >> SR_FP_SHIFT;
+	}
+}
+
+// Local mean sidereal time at the instant t (nanoseconds since the epoch),
+// in nanoseconds since sidereal midnight, by IAU 2006 and DUT1.
+static inline long long gmst06_nanos(long long t) {
+	if (sr_day.per_sec == 0 || t < sr_day.start || t - sr_day.start >= SR_DAY_IN_NANOS) {
+		long long day = t / SR_DAY_IN_NANOS;
+		if (t < 0 && t % SR_DAY_IN_NANOS) day--;
+		sr_day_compute(&sr_day, day);
+	}
+	long long since = t - sr_day.start;
+	uint64_t st = sr_day.base + (uint64_t)(since / SR_SECOND_IN_NANOS) * sr_day.per_sec
+		+ (((uint64_t)(since % SR_SECOND_IN_NANOS) * sr_day.per_ns) >> (32 - SR_FP_SHIFT));
+	return (long long)((st % SR_DAY_FP) >> SR_FP_SHIFT);
+}
+
+#endif
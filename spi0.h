@@ -0,0 +1,222 @@
+/*
+
+Direct SPI0 register access for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+Going through spidev costs an ioctl, the SPI core and the bcm2835 driver for
+every frame, and that's where most of the variance in our commit times comes
+from. This instead maps the SPI0 controller's registers and pushes the bytes
+straight into its TX FIFO, polling for DONE. No system calls at all.
+
+The spidev device still gets opened and locked. That sets up the pins and
+keeps anyone else away from the bus, but we take over the controller itself,
+so nothing else may use SPI0 (not even the other chip select) while we run.
+
+For trying this out off of a Pi, the register block can instead be a plain
+file. Then the register accesses go through a small model of the controller
+(the FIFOs, TA and DONE), and every message that would have been latched by
+the MAX6951 when chip select went back up is logged in the file.
+
+*/
+
+#ifndef SPI0_H
+#define SPI0_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "bcm2835.h"
+
+#ifndef _BV
+#define _BV(n) (1 << n)
+#endif
+
+// Register word indices
+#define SPI0_CS 0
+#define SPI0_FIFO 1
+#define SPI0_CLK 2
+#define SPI0_DLEN 3
+#define SPI0_LTOH 4
+#define SPI0_DC 5
+#define SPI0_REGS 6
+
+// CS register bits. The chip select field (bits 0-1) is 0 for CE0, and we
+// want mode 0, so CPOL and CPHA stay clear.
+#define SPI0_CS_TXD _BV(18) // TX FIFO can take more
+#define SPI0_CS_RXD _BV(17) // RX FIFO has something in it
+#define SPI0_CS_DONE _BV(16) // transfer complete
+// How many times to look for DONE before giving up. A message takes a couple
+// of microseconds (see SPI0_CDIV), and this is milliseconds of register reads.
+#define SPI0_DONE_SPINS 100000UL
+#define SPI0_CS_TA _BV(7) // transfer active - chip select asserted
+#define SPI0_CS_CLEAR_RX _BV(5)
+#define SPI0_CS_CLEAR_TX _BV(4)
+#define SPI0_CS_CPOL _BV(3)
+#define SPI0_CS_CPHA _BV(2)
+
+#define SPI0_FIFO_DEPTH 16
+
+// The SPI clock is the core clock divided by this. The core clock is 250 MHz
+// on the early Pis, 400 MHz on the Zero and 3, and 500 MHz on the 4, so this
+// keeps us under the MAX6951's 26 MHz limit on all of them.
+#define SPI0_CDIV 32
+
+// The emulated controller
+#define SPI0_EMUL_LOG 4096
+struct spi0_emul {
+	uint32_t regs[8]; // what the code reads and writes
+	uint32_t tx_count; // bytes waiting in the TX FIFO
+	uint32_t rx_count; // bytes waiting in the RX FIFO
+	uint32_t msg_len; // bytes shifted out since TA was raised
+	uint8_t tx[SPI0_FIFO_DEPTH];
+	uint8_t msg[SPI0_FIFO_DEPTH];
+	uint32_t latched; // messages logged. The newest is log[(latched - 1) % SPI0_EMUL_LOG].
+	uint8_t log[SPI0_EMUL_LOG][2]; // the first two bytes of each message
+};
+
+static volatile uint32_t *spi0_regs = NULL;
+static struct spi0_emul *spi0_emul = NULL;
+
+// With TA up, the emulated wire is infinitely fast: anything in the TX FIFO
+// goes straight out, and a zero comes back for each byte (the MAX6951 has
+// no DOUT).
+static inline void spi0_emul_shift() {
+	struct spi0_emul *e = spi0_emul;
+	if (!(e->regs[SPI0_CS] & SPI0_CS_TA)) return;
+	for(uint32_t i = 0; i < e->tx_count; i++) {
+		if (e->msg_len < SPI0_FIFO_DEPTH) e->msg[e->msg_len++] = e->tx[i];
+		if (e->rx_count < SPI0_FIFO_DEPTH) e->rx_count++;
+	}
+	e->tx_count = 0;
+}
+
+static inline uint32_t spi0_emul_read(int reg) {
+	struct spi0_emul *e = spi0_emul;
+	switch(reg) {
+		case SPI0_CS: {
+			uint32_t cs = e->regs[SPI0_CS] & ~(SPI0_CS_TXD | SPI0_CS_RXD | SPI0_CS_DONE);
+			if (e->tx_count < SPI0_FIFO_DEPTH) cs |= SPI0_CS_TXD;
+			if (e->rx_count) cs |= SPI0_CS_RXD;
+			if ((cs & SPI0_CS_TA) && e->tx_count == 0) cs |= SPI0_CS_DONE;
+			return cs;
+		}
+		case SPI0_FIFO:
+			if (e->rx_count) e->rx_count--;
+			return 0;
+		default:
+			return e->regs[reg];
+	}
+}
+
+static inline void spi0_emul_write(int reg, uint32_t val) {
+	struct spi0_emul *e = spi0_emul;
+	switch(reg) {
+		case SPI0_CS: {
+			if (val & SPI0_CS_CLEAR_TX) e->tx_count = 0;
+			if (val & SPI0_CS_CLEAR_RX) e->rx_count = 0;
+			uint32_t was = e->regs[SPI0_CS];
+			e->regs[SPI0_CS] = val & ~(SPI0_CS_CLEAR_TX | SPI0_CS_CLEAR_RX | SPI0_CS_TXD | SPI0_CS_RXD | SPI0_CS_DONE);
+			if (!(was & SPI0_CS_TA) && (val & SPI0_CS_TA)) {
+				e->msg_len = 0;
+				spi0_emul_shift();
+			} else if ((was & SPI0_CS_TA) && !(val & SPI0_CS_TA)) {
+				// Chip select went back up. This is where the MAX6951 latches.
+				if (e->msg_len >= 2) {
+					memcpy(e->log[e->latched % SPI0_EMUL_LOG], e->msg, 2);
+					__atomic_store_n(&e->latched, e->latched + 1, __ATOMIC_RELEASE);
+				}
+				e->msg_len = 0;
+			}
+			break;
+		}
+		case SPI0_FIFO:
+			if (e->tx_count < SPI0_FIFO_DEPTH) e->tx[e->tx_count++] = (uint8_t)val;
+			spi0_emul_shift();
+			break;
+		default:
+			e->regs[reg] = val;
+			break;
+	}
+}
+
+static inline uint32_t spi0_read(int reg) {
+	if (spi0_emul != NULL) return spi0_emul_read(reg);
+	return spi0_regs[reg];
+}
+
+static inline void spi0_write(int reg, uint32_t val) {
+	if (spi0_emul != NULL) {
+		spi0_emul_write(reg, val);
+		return;
+	}
+	spi0_regs[reg] = val;
+}
+
+// Map the controller. path is /dev/mem for the real thing, or any other
+// file to emulate it. Returns 0 on success.
+static inline int spi0_open(const char *path) {
+	if (!strcmp(path, "/dev/mem")) {
+		spi0_regs = bcm_map(BCM_SPI0_OFFSET, 4096);
+		if (spi0_regs == NULL) return -1;
+	} else {
+		int fd = open(path, O_RDWR | O_CREAT, 0644);
+		if (fd < 0) return -1;
+		if (ftruncate(fd, sizeof(struct spi0_emul))) {
+			close(fd);
+			return -1;
+		}
+		void *p = mmap(NULL, sizeof(struct spi0_emul), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return -1;
+		spi0_emul = (struct spi0_emul *)p;
+		spi0_emul->tx_count = spi0_emul->rx_count = spi0_emul->msg_len = 0;
+		spi0_emul->regs[SPI0_CS] = 0;
+		spi0_regs = spi0_emul->regs;
+	}
+	spi0_write(SPI0_CS, SPI0_CS_CLEAR_TX | SPI0_CS_CLEAR_RX);
+	spi0_write(SPI0_CLK, SPI0_CDIV);
+	return 0;
+}
+
+// Send n two byte messages, raising chip select after each one. This is
+// the same thing the spidev commit does with cs_change. Returns 0, or -1
+// if the controller never said a message was done, in which case the rest
+// aren't sent and the transfer is abandoned.
+static inline int spi0_commit(const unsigned char (*msgs)[2], int n) {
+	for(int i = 0; i < n; i++) {
+		spi0_write(SPI0_CS, SPI0_CS_CLEAR_TX | SPI0_CS_CLEAR_RX | SPI0_CS_TA);
+		spi0_write(SPI0_FIFO, msgs[i][0]);
+		spi0_write(SPI0_FIFO, msgs[i][1]);
+		unsigned long spins = 0;
+		while(!(spi0_read(SPI0_CS) & SPI0_CS_DONE)) {
+			if (++spins == SPI0_DONE_SPINS) {
+				spi0_write(SPI0_CS, SPI0_CS_CLEAR_TX | SPI0_CS_CLEAR_RX);
+				return -1;
+			}
+		}
+		// We don't care what came back, but it has to be drained.
+		while(spi0_read(SPI0_CS) & SPI0_CS_RXD) (void)spi0_read(SPI0_FIFO);
+		spi0_write(SPI0_CS, 0);
+	}
+	return 0;
+}
+
+#endif
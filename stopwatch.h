@@ -0,0 +1,138 @@
+/*
+
+Stopwatch for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The stopwatch runs on CLOCK_MONOTONIC, so stepping the system clock doesn't
+touch it. Commands (see control.h) take effect at the instant they arrived,
+not when the display thread gets to them:
+
+start - start, or carry on after a stop
+stop - stop, and show where it stopped
+lap - keep going, but show the time so far (and the lap number) for a
+few seconds
+reset - back to zero (and keep going if it was going)
+
+Under an hour it shows minutes, seconds and hundredths, and a lap number
+in the last digit. After that, hours, minutes, seconds and tenths.
+
+*/
+
+#ifndef STOPWATCH_H
+#define STOPWATCH_H
+
+#include <string.h>
+
+#define SW_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+#define SW_HUNDREDTH_IN_NANOS (SW_SECOND_IN_NANOS / 100)
+#define SW_TENTH_IN_NANOS (SW_SECOND_IN_NANOS / 10)
+#define SW_HOUR_IN_NANOS (3600LL * SW_SECOND_IN_NANOS)
+// How long a lap time stays up
+#define SW_LAP_HOLD (5LL * SW_SECOND_IN_NANOS)
+// The MAX6951's code B blank
+#define SW_BLANK 0x0f
+
+struct sw_state {
+	unsigned char running;
+	long long base; // when it would have started, had it never stopped
+	long long held; // the time when stopped
+	long long lap; // the last lap time
+	long long lap_until; // when to stop showing it
+	int laps;
+};
+
+// Returns 0 if it was a stopwatch command.
+static inline int sw_command(struct sw_state *s, const char *cmd, long long when) {
+	if (!strcmp(cmd, "start")) {
+		if (!s->running) {
+			s->base = when - s->held;
+			s->running = 1;
+		}
+	} else if (!strcmp(cmd, "stop")) {
+		if (s->running) {
+			s->held = when - s->base;
+			s->running = 0;
+			s->lap_until = 0;
+		}
+	} else if (!strcmp(cmd, "lap")) {
+		if (s->running) {
+			s->lap = when - s->base;
+			s->lap_until = when + SW_LAP_HOLD;
+			s->laps++;
+		}
+	} else if (!strcmp(cmd, "reset")) {
+		s->held = 0;
+		s->base = when;
+		s->lap_until = 0;
+		s->laps = 0;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// The time to show at now, and whether it's a lap time.
+static inline long long sw_shown(const struct sw_state *s, long long now, int *lap) {
+	*lap = s->running && now < s->lap_until;
+	if (*lap) return s->lap;
+	return s->running?now - s->base:s->held;
+}
+
+// When the display next changes after now, or 0 if it doesn't by itself.
+static inline long long sw_next(const struct sw_state *s, long long now) {
+	if (!s->running) return 0;
+	if (now < s->lap_until) return s->lap_until;
+	long long period = (now - s->base < SW_HOUR_IN_NANOS)?SW_HUNDREDTH_IN_NANOS:SW_TENTH_IN_NANOS;
+	return s->base + ((now - s->base) / period + 1) * period;
+}
+
+// The seven digits (code B) and the misc digit's colons, for t.
+static inline void sw_digits(long long t, int lap, int laps, unsigned char *digits, unsigned char *colons_hm,
+		unsigned char *colons_ms) {
+	if (t < SW_HOUR_IN_NANOS) {
+		long long hundredths = t / SW_HUNDREDTH_IN_NANOS;
+		int min = (int)(hundredths / 6000);
+		int sec = (int)((hundredths / 100) % 60);
+		int hs = (int)(hundredths % 100);
+		digits[0] = (min < 10)?SW_BLANK:min / 10;
+		digits[1] = min % 10;
+		digits[2] = sec / 10;
+		digits[3] = sec % 10; // and the decimal point
+		digits[4] = hs / 10;
+		digits[5] = hs % 10;
+		digits[6] = lap?laps % 10:SW_BLANK;
+		*colons_hm = 1;
+		*colons_ms = 0;
+	} else {
+		long long tenths = t / SW_TENTH_IN_NANOS;
+		int hour = (int)((tenths / 36000) % 100);
+		int min = (int)((tenths / 600) % 60);
+		int sec = (int)((tenths / 10) % 60);
+		digits[0] = (hour < 10)?SW_BLANK:hour / 10;
+		digits[1] = hour % 10;
+		digits[2] = min / 10;
+		digits[3] = min % 10;
+		digits[4] = sec / 10;
+		digits[5] = sec % 10; // and the decimal point
+		digits[6] = (int)(tenths % 10);
+		*colons_hm = 1;
+		*colons_ms = 1;
+	}
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+
+Time sources for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+A time source decides two things: where the tick boundaries fall, and what
+the digits say at each one. There are six:
+
+civil - local time, from localtime_r().
+UTC - no time zone, so it's just arithmetic.
+sidereal - Local Mean Sidereal Time (Greenwich by default), whose seconds are
+a little shorter than ours, so its boundaries don't land on ours.
+sidereal06 - the same, but by IAU 2006 and corrected for UT1 (see sidereal.h).
+zones - local time in each of a list of zones in turn (-z). See zones.h.
+countdown - the time left until an instant (-C). Its boundaries are counted
+back from that instant, so the last one is the instant itself, showing all
+zeros. After that, it holds there (or blinks) or counts back up.
+
+Either sidereal source can be made apparent rather than mean (-a).
+
+With a leap mode (see leap.h), civil and UTC ticks are CLOCK_TAI instants
+rather than CLOCK_REALTIME ones (and so are zones ticks), and go through
+leap_posix() on the way to the digits. TAI and UTC seconds line up, so the tenth and second grids
+don't move. Minutes and anything smeared go by way of the display's time.
+
+Every function here takes the source as its first argument. The display
+thread is built once for each source with that argument a constant, so the
+compiler folds the switches away and inlines what's left - there's no call
+through a pointer on the hot path.
+
+*/
+
+#ifndef TIMESOURCE_H
+#define TIMESOURCE_H
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "sidereal.h"
+#include "leap.h"
+#include "zones.h"
+
+#define TS_CIVIL 0
+#define TS_UTC 1
+#define TS_SIDEREAL 2
+#define TS_SIDEREAL06 3
+#define TS_COUNTDOWN 4
+#define TS_ZONES 5
+#define TS_COUNT 6
+
+#define TS_IS_SIDEREAL(src) ((src) == TS_SIDEREAL || (src) == TS_SIDEREAL06)
+
+#define TS_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+#define TS_TENTH_IN_NANOS (TS_SECOND_IN_NANOS / 10)
+#define TS_DAY (24 * 60 * 60)
+
+// Sidereal ticks land this far past the boundary they're for, so that the
+// rounding in getting there never leaves us showing the one before.
+#define BOUNDARY_NUDGE (1000L)
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+static const char *ts_names[TS_COUNT] = { "civil", "utc", "sidereal", "sidereal06", "countdown", "zones" };
+
+// What the countdown does once it gets to zero
+#define CD_HOLD 0
+#define CD_BLINK 1 // hold, and blink with the MAX6951's blink timer
+#define CD_UP 2 // count the time since
+
+// The countdown's target, on the tick clock. The display thread owns these
+// once it's running.
+static long long countdown_target = 0;
+static unsigned char countdown_after = CD_HOLD;
+
+// What the digits say
+struct ts_digits {
+	int hour; // 0-23
+	int min;
+	int sec;
+	int tenth;
+	int zone; // which of the zones it is (TS_ZONES only)
+};
+
+static ALWAYS_INLINE long long ts_sidereal_nanos(int src, long long t) {
+	long long st = (src == TS_SIDEREAL06)?gmst06_nanos(t):sidereal_nanos(t);
+	return apparent?sidereal_apparent(st, t):st;
+}
+
+// The tick boundary at or before t. Every period divides the day (either
+// kind), so midnight isn't special.
+static ALWAYS_INLINE long long ts_floor(int src, long long t, long long period) {
+	switch(src) {
+		case TS_SIDEREAL:
+		case TS_SIDEREAL06: {
+			long long since = ts_sidereal_nanos(src, t) % period;
+			return t - (long long)(since / SIDEREAL_RATE) + BOUNDARY_NUDGE;
+		}
+		case TS_COUNTDOWN: {
+			// Once it's done, zero is the last tick there is.
+			if (t >= countdown_target && countdown_after != CD_UP) return countdown_target;
+			long long since = t - countdown_target;
+			long long n = since / period;
+			if (since % period < 0) n--; // round down, not toward zero
+			return countdown_target + n * period;
+		}
+		default:
+			if (leap_mode == LEAP_SMEAR || (leap_mode && period > TS_SECOND_IN_NANOS)) {
+				long long d = leap_to_posix(t);
+				return leap_tai((d / period) * period);
+			}
+			return (t / period) * period;
+	}
+}
+
+// The tick boundary after tick.
+static ALWAYS_INLINE long long ts_next(int src, long long tick, long long period) {
+	switch(src) {
+		case TS_SIDEREAL:
+		case TS_SIDEREAL06: {
+			long long until = period - ts_sidereal_nanos(src, tick) % period;
+			return tick + (long long)(until / SIDEREAL_RATE) + BOUNDARY_NUDGE;
+		}
+		case TS_COUNTDOWN:
+			// The period may have changed since tick.
+			return ts_floor(src, tick, period) + period;
+		default:
+			if (leap_mode == LEAP_SMEAR || (leap_mode && period > TS_SECOND_IN_NANOS)) {
+				long long d = leap_to_posix(tick);
+				return leap_tai((d / period + 1) * period);
+			}
+			return (tick / period + 1) * period;
+	}
+}
+
+// What to show at the instant tick.
+static ALWAYS_INLINE void ts_digits(int src, long long tick, struct ts_digits *d) {
+	int in_leap = 0;
+	if ((src == TS_CIVIL || src == TS_UTC || src == TS_ZONES) && leap_mode) tick = leap_posix(tick, &in_leap);
+	switch(src) {
+		case TS_CIVIL: {
+			time_t sec = (time_t)(tick / TS_SECOND_IN_NANOS);
+			struct tm lt;
+			localtime_r(&sec, &lt);
+			d->hour = lt.tm_hour;
+			d->min = lt.tm_min;
+			d->sec = lt.tm_sec + in_leap;
+			d->tenth = (int)((tick % TS_SECOND_IN_NANOS) / TS_TENTH_IN_NANOS);
+			break;
+		}
+		case TS_UTC: {
+			int day_sec = (int)((tick / TS_SECOND_IN_NANOS) % TS_DAY);
+			d->hour = day_sec / 3600;
+			d->min = (day_sec / 60) % 60;
+			d->sec = day_sec % 60 + in_leap;
+			d->tenth = (int)((tick % TS_SECOND_IN_NANOS) / TS_TENTH_IN_NANOS);
+			break;
+		}
+		case TS_ZONES: {
+			// No localtime_r(): the zone's offset was worked out ahead.
+			long long sec = tick / TS_SECOND_IN_NANOS;
+			d->zone = zone_which(sec);
+			int day_sec = (int)((sec + zone_offset(&zone_table[d->zone], sec)) % TS_DAY);
+			d->hour = day_sec / 3600;
+			d->min = (day_sec / 60) % 60;
+			d->sec = day_sec % 60 + in_leap;
+			d->tenth = (int)((tick % TS_SECOND_IN_NANOS) / TS_TENTH_IN_NANOS);
+			break;
+		}
+		case TS_SIDEREAL:
+		case TS_SIDEREAL06: {
+			long long st = ts_sidereal_nanos(src, tick) / TS_TENTH_IN_NANOS;
+			d->hour = (int)(st / 36000);
+			d->min = (int)((st / 600) % 60);
+			d->sec = (int)((st / 10) % 60);
+			d->tenth = (int)(st % 10);
+			break;
+		}
+		case TS_COUNTDOWN: {
+			// Ticks are whole periods from the target, so this is exact.
+			long long left = (tick < countdown_target)?countdown_target - tick:tick - countdown_target;
+			left /= TS_TENTH_IN_NANOS;
+			d->hour = (int)(left / 36000);
+			if (d->hour > 99) d->hour = 99;
+			d->min = (int)((left / 600) % 60);
+			d->sec = (int)((left / 10) % 60);
+			d->tenth = (int)(left % 10);
+			break;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,258 @@
+/*
+
+Time of day tables for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The brightness schedule is a list of times of day (local civil time) and
+the intensity to go to at each one, like "07:00=15,22:30=3/45". The /45
+means to ramp there over 45 minutes, one level at a time, instead of
+jumping. The schedule wraps around midnight.
+
+The display-off windows are a list of ranges of local time, like
+"01:00-06:00,12:00-13:00", during which the display is shut down. A window
+may span midnight.
+
+The display thread evaluates both on its ticks, but only does the work when
+the cached instant of the next change comes around. That means a
+localtime_r() and a mktime() every now and then, and no timers of their own.
+
+*/
+
+#ifndef TIMETABLE_H
+#define TIMETABLE_H
+
+#include <stdlib.h>
+#include <time.h>
+
+#define TT_DAY (24 * 60 * 60)
+#define TT_SECOND_IN_NANOS (1000LL * 1000LL * 1000LL)
+
+#define BRIGHT_MAX 32
+#define OFF_MAX 16
+
+struct bright_entry {
+	int start; // seconds into the local day
+	int ramp; // seconds
+	int level; // 0-15
+};
+
+struct off_window {
+	int start; // seconds into the local day
+	int end;
+};
+
+static struct bright_entry bright_table[BRIGHT_MAX];
+static int bright_count = 0;
+static struct off_window off_table[OFF_MAX];
+static int off_count = 0;
+
+// Parse "HH:MM" into seconds of the day. Returns the end of it, or NULL.
+static inline const char *tt_parse_time(const char *p, int *out) {
+	char *end;
+	long h = strtol(p, &end, 10);
+	if (end == p || *end != ':' || h < 0 || h > 24) return NULL;
+	p = end + 1;
+	long m = strtol(p, &end, 10);
+	if (end == p || m < 0 || m > 59 || h * 60 + m > 24 * 60) return NULL;
+	*out = (int)((h * 60 + m) * 60) % TT_DAY;
+	return end;
+}
+
+// Parse into table, with the count in *count. Returns 0 on success.
+static inline int bright_parse_into(const char *spec, struct bright_entry *table, int *count) {
+	int n = 0;
+	const char *p = spec;
+	while(*p) {
+		if (n == BRIGHT_MAX) return -1;
+		struct bright_entry e;
+		char *end;
+		p = tt_parse_time(p, &e.start);
+		if (p == NULL || *p++ != '=') return -1;
+		e.level = (int)strtol(p, &end, 10);
+		if (end == p || e.level < 0 || e.level > 15) return -1;
+		p = end;
+		e.ramp = 0;
+		if (*p == '/') {
+			p++;
+			long ramp = strtol(p, &end, 10);
+			if (end == p || ramp < 0 || ramp >= 24 * 60) return -1;
+			e.ramp = (int)ramp * 60;
+			p = end;
+		}
+		if (*p == ',') p++;
+		else if (*p) return -1;
+		// Keep them in order of time of day.
+		int i = n++;
+		while(i > 0 && table[i - 1].start > e.start) {
+			table[i] = table[i - 1];
+			i--;
+		}
+		table[i] = e;
+	}
+	*count = n;
+	return n?0:-1;
+}
+
+static inline int bright_parse(const char *spec) {
+	return bright_parse_into(spec, bright_table, &bright_count);
+}
+
+// The level at second x of the day. *next is when (in seconds from the
+// start of the same day, so possibly past TT_DAY) it next changes.
+static inline int bright_level(int x, int *next) {
+	// The last entry at or before x - which may be yesterday's last one.
+	int i = bright_count - 1;
+	int day = 0;
+	while(i >= 0 && bright_table[i].start > x) i--;
+	if (i < 0) {
+		i = bright_count - 1;
+		day = -TT_DAY;
+	}
+	const struct bright_entry *e = &bright_table[i];
+	int from = bright_table[(i + bright_count - 1) % bright_count].level;
+	int start = e->start + day;
+	// The one after it is where the next change is, unless we're ramping.
+	*next = (i + 1 < bright_count)?bright_table[i + 1].start + day:bright_table[0].start + day + TT_DAY;
+	int delta = e->level - from;
+	if (x >= start + e->ramp || delta == 0) return e->level;
+	// Part way up (or down) the ramp. The level takes another step when
+	// |delta| * elapsed / ramp next reaches a whole number.
+	int steps = abs(delta);
+	int elapsed = x - start;
+	int done = (int)((long long)steps * elapsed / e->ramp);
+	int step_at = start + (int)(((long long)(done + 1) * e->ramp + steps - 1) / steps);
+	if (step_at < *next) *next = step_at;
+	return from + ((delta > 0)?done:-done);
+}
+
+// Parse "HH:MM-HH:MM,..." into table. Returns 0 on success.
+static inline int off_parse_into(const char *spec, struct off_window *table, int *count) {
+	int n = 0;
+	const char *p = spec;
+	while(*p) {
+		if (n == OFF_MAX) return -1;
+		struct off_window w;
+		p = tt_parse_time(p, &w.start);
+		if (p == NULL || *p++ != '-') return -1;
+		p = tt_parse_time(p, &w.end);
+		if (p == NULL || w.start == w.end) return -1;
+		if (*p == ',') p++;
+		else if (*p) return -1;
+		table[n++] = w;
+	}
+	*count = n;
+	return n?0:-1;
+}
+
+static inline int off_parse(const char *spec) {
+	return off_parse_into(spec, off_table, &off_count);
+}
+
+// If second x of the day (which may be past TT_DAY) is in a window, the
+// end of it, on the same scale. Otherwise -1.
+static inline int off_window_end(int x) {
+	int day = (x / TT_DAY) * TT_DAY;
+	int t = x - day;
+	for(int i = 0; i < off_count; i++) {
+		const struct off_window *w = &off_table[i];
+		if (w->start < w->end) {
+			if (t >= w->start && t < w->end) return day + w->end;
+		} else {
+			if (t >= w->start) return day + TT_DAY + w->end;
+			if (t < w->end) return day + w->end;
+		}
+	}
+	return -1;
+}
+
+// Whether second x of the day is in an off window. *change is when that
+// next changes (in seconds from the start of the same day).
+static inline int off_at(int x, int *change) {
+	int end = off_window_end(x);
+	if (end >= 0) {
+		// Windows that overlap or abut run together.
+		for(int i = 0; i < off_count; i++) {
+			int further = off_window_end(end);
+			if (further < 0) break;
+			end = further;
+		}
+		*change = end;
+		return 1;
+	}
+	*change = x + TT_DAY;
+	for(int i = 0; i < off_count; i++) {
+		int start = off_table[i].start + ((off_table[i].start > x)?0:TT_DAY);
+		if (start < *change) *change = start;
+	}
+	return 0;
+}
+
+// Turn second "when" of the day that lt (the instant now) falls in into the
+// next instant it happens, going by the calendar so that daylight saving
+// changes come out right. In the hour that's repeated in the fall, mktime()
+// can pick either time round, and the first may be behind us already, so
+// both are tried. Whatever happens, the answer is after now.
+static inline long long tt_instant(const struct tm *lt, long long now, int when) {
+	// The wall clock fields themselves: mktime() would take an offset of
+	// seconds from midnight at midnight's daylight saving.
+	struct tm t = *lt;
+	t.tm_mday += when / TT_DAY;
+	when %= TT_DAY;
+	t.tm_hour = when / 3600;
+	t.tm_min = (when / 60) % 60;
+	t.tm_sec = when % 60;
+	t.tm_isdst = -1;
+	struct tm want = t;
+	long long best = (long long)mktime(&want) * TT_SECOND_IN_NANOS;
+	if (best <= now) best = 0;
+	for(int dst = 0; dst <= 1; dst++) {
+		struct tm c = t;
+		c.tm_isdst = dst;
+		long long at = (long long)mktime(&c) * TT_SECOND_IN_NANOS;
+		// Asking for the wrong one moves the wall clock time. That isn't it.
+		if (c.tm_mday != want.tm_mday || c.tm_hour != want.tm_hour || c.tm_min != want.tm_min) continue;
+		if (at > now && (best == 0 || at < best)) best = at;
+	}
+	return best?best:(now / TT_SECOND_IN_NANOS + 1) * TT_SECOND_IN_NANOS;
+}
+
+// The brightness at the given instant (ns since the epoch), and the instant
+// at which to look again.
+static inline int bright_eval(long long tick, long long *next) {
+	time_t sec = (time_t)(tick / TT_SECOND_IN_NANOS);
+	struct tm lt;
+	localtime_r(&sec, &lt);
+	int when;
+	int level = bright_level(lt.tm_hour * 3600 + lt.tm_min * 60 + lt.tm_sec, &when);
+	*next = tt_instant(&lt, tick, when);
+	return level;
+}
+
+// Whether the display should be off at the given instant, and when that
+// changes.
+static inline int off_eval(long long t, long long *next) {
+	time_t sec = (time_t)(t / TT_SECOND_IN_NANOS);
+	struct tm lt;
+	localtime_r(&sec, &lt);
+	int when;
+	int off = off_at(lt.tm_hour * 3600 + lt.tm_min * 60 + lt.tm_sec, &when);
+	*next = tt_instant(&lt, t, when);
+	return off;
+}
+
+#endif
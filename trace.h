@@ -0,0 +1,171 @@
+/*
+
+Per-tick trace ring for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+The clock records every tick into a fixed size ring of binary records in a
+file that's mmap'd shared, so that it survives the process and can be looked
+at after the fact with SPI_Trace.
+
+There is exactly one writer - the timer thread. The ring is never locked.
+Each record carries its sequence number, which the writer clears before it
+touches the record and sets again when it's done. A reader that sees the same
+sequence number before and after copying a record got a consistent copy.
+
+Nothing here allocates or makes a system call once the ring is open. The
+commit timestamps come from the BCM2835 system timer when we can map it,
+because on ARMv6 there's no vDSO and clock_gettime() is a real system call.
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "bcm2835.h"
+
+#define TRACE_MAGIC 0x43525453 // "STRC"
+#define TRACE_VERSION 1
+// About 27 minutes at ten ticks a second. A megabyte of tmpfs.
+#define TRACE_SLOTS 16384
+#define TRACE_MAX_REGS 12
+
+#ifndef _BV
+#define _BV(n) (1 << n)
+#endif
+
+// Record flags
+#define TRACE_LATE _BV(0) // started more than LATE_SLOP after the target
+#define TRACE_SKIPPED _BV(1) // one or more ticks before this one were never shown
+#define TRACE_EARLY _BV(2) // woke up too early and went back to sleep. Nothing written.
+#define TRACE_CATCHUP _BV(3) // showed a missed tick (late policy)
+#define TRACE_DEGRADED _BV(4) // tenths were dropped (degrade policy)
+#define TRACE_FIRST _BV(5) // the first tick after startup
+#define TRACE_OFF _BV(6) // the display was shut down for an off window
+#define TRACE_FLIP _BV(7) // staged in the hidden plane and flipped in (-F)
+#define TRACE_TEXT _BV(8) // a step of a text message rather than the time
+#define TRACE_KICK _BV(9) // woken by a signal (the control socket, a reload), not the timer
+#define TRACE_STAGED _BV(10) // the next digits, sent to the hidden plane ahead of a flip (-F)
+
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t slots;
+	uint32_t head; // sequence number of the next record to be written
+	int64_t fudge; // the FUDGE of the writer, so readers can judge the wakeups
+	uint8_t pad[40];
+};
+
+// All times are nanoseconds on the display thread's clock: since the epoch
+// on CLOCK_REALTIME, or CLOCK_TAI with -L, and since boot on CLOCK_MONOTONIC
+// for the stopwatch.
+struct trace_record {
+	int64_t target; // the instant this tick displays
+	int64_t wakeup;
+	int64_t commit_start;
+	int64_t commit_end;
+	uint32_t seq; // 0 while the record is being written
+	uint16_t flags;
+	uint8_t nregs;
+	uint8_t pad;
+	uint8_t regs[TRACE_MAX_REGS][2]; // register, data
+};
+
+static struct trace_header *trace_hdr = NULL;
+static struct trace_record *trace_ring = NULL;
+static volatile uint32_t *trace_stc = NULL;
+
+static inline size_t trace_file_size() {
+	return sizeof(struct trace_header) + TRACE_SLOTS * sizeof(struct trace_record);
+}
+
+// Open (or create) the trace file for writing. Returns 0 on success. The
+// sequence numbers carry on from whatever was there before, so a restart
+// doesn't wipe out the evidence of why we restarted.
+static inline int trace_open(const char *path, int64_t fudge) {
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) return -1;
+	if (ftruncate(fd, (off_t)trace_file_size())) {
+		close(fd);
+		return -1;
+	}
+	void *p = mmap(NULL, trace_file_size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return -1;
+	trace_hdr = (struct trace_header *)p;
+	trace_ring = (struct trace_record *)(trace_hdr + 1);
+	if (trace_hdr->magic != TRACE_MAGIC || trace_hdr->version != TRACE_VERSION ||
+		trace_hdr->record_size != sizeof(struct trace_record) || trace_hdr->slots != TRACE_SLOTS) {
+		memset(p, 0, trace_file_size());
+		trace_hdr->version = TRACE_VERSION;
+		trace_hdr->record_size = sizeof(struct trace_record);
+		trace_hdr->slots = TRACE_SLOTS;
+		trace_hdr->head = 1; // 0 is reserved to mean "not valid"
+		__atomic_store_n(&trace_hdr->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+	}
+	trace_hdr->fudge = fudge;
+	if (trace_hdr->head == 0) trace_hdr->head = 1;
+	trace_stc = bcm_map(BCM_ST_OFFSET, 4096);
+	return 0;
+}
+
+// A cheap, wrapping microsecond counter for timing the commit.
+static inline uint32_t trace_clock() {
+	if (trace_stc != NULL) return trace_stc[BCM_ST_CLO];
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000000U + (uint32_t)(ts.tv_nsec / 1000);
+}
+
+// Claim the next record. Returns NULL if tracing is off.
+static inline struct trace_record *trace_begin() {
+	if (trace_hdr == NULL) return NULL;
+	struct trace_record *r = &trace_ring[trace_hdr->head % TRACE_SLOTS];
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return r;
+}
+
+// Publish the record.
+static inline void trace_end(struct trace_record *r) {
+	if (r == NULL) return;
+	uint32_t seq = trace_hdr->head;
+	__atomic_store_n(&r->seq, seq, __ATOMIC_RELEASE);
+	if (++seq == 0) seq = 1;
+	__atomic_store_n(&trace_hdr->head, seq, __ATOMIC_RELEASE);
+}
+
+// Copy record seq out of the ring. Returns 0 if it was overwritten (or
+// not yet written) while we looked.
+static inline int trace_read(const struct trace_header *hdr, uint32_t seq, struct trace_record *out) {
+	const struct trace_record *ring = (const struct trace_record *)(hdr + 1);
+	const struct trace_record *r = &ring[seq % hdr->slots];
+	if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != seq) return 0;
+	memcpy(out, (const void *)r, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == seq && out->seq == seq;
+}
+
+#endif
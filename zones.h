@@ -0,0 +1,157 @@
+/*
+
+Time zone rotation for the SPI Clock
+Copyright 2017 Nicholas Sayer
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+
+With -z, the clock takes turns showing the time in each of a list of zones,
+like "local,UTC,Asia/Tokyo", a few seconds each.
+
+The C library only knows one time zone at a time - whatever TZ says - and
+switching means setenv() and tzset(), which reads the zone file. Not on a
+tick, and not while the display thread might be in localtime_r() for the
+brightness schedule. So before there are any threads, each zone's offsets
+from UTC are worked out for years ahead, with the instants at which they
+change. On a tick, the time in a zone is just the time plus an offset, and
+which offset is a matter of whether we've got to the next change yet.
+
+Zone file updates (new daylight saving rules) need a restart, as they
+would for the local time anyway.
+
+*/
+
+#ifndef ZONES_H
+#define ZONES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ZONE_MAX 4 // the misc digit's G and DP tell them apart
+#define ZONE_CHANGES 64
+// How far ahead to work out the changes. Two a year at most, as a rule.
+#define ZONE_YEARS 20
+#define ZONE_DAY (24 * 60 * 60)
+
+struct zone {
+	char name[48];
+	int count;
+	long long at[ZONE_CHANGES]; // POSIX seconds. at[0] is the beginning of time.
+	int offset[ZONE_CHANGES]; // seconds east of UTC, from at[i]
+	int cur; // the one we're in, as of the last lookup
+};
+
+static struct zone zone_table[ZONE_MAX];
+static int zone_count = 0;
+static int zone_rotate = 5; // seconds for each
+// TZ as we found it, for "local". NULL if it wasn't set.
+static const char *zone_local_tz = NULL;
+static char zone_local_buf[256];
+
+static inline int zone_gmtoff(time_t t) {
+	struct tm lt;
+	localtime_r(&t, &lt);
+	return (int)lt.tm_gmtoff;
+}
+
+static inline void zone_set_tz(const char *tz) {
+	if (tz) setenv("TZ", tz, 1);
+	else unsetenv("TZ");
+	tzset();
+}
+
+// Work out one zone's offsets from the second from for ZONE_YEARS. This
+// changes TZ, and doesn't put it back.
+static inline void zone_scan(struct zone *z, long long from) {
+	zone_set_tz(strcmp(z->name, "local")?z->name:zone_local_tz);
+	time_t t = (time_t)from;
+	int off = zone_gmtoff(t);
+	z->count = 1;
+	z->at[0] = -(1LL << 62);
+	z->offset[0] = off;
+	z->cur = 0;
+	// A day at a time, then narrow down any change to the second.
+	for(int day = 0; day < ZONE_YEARS * 366 && z->count < ZONE_CHANGES; day++, t += ZONE_DAY) {
+		int next = zone_gmtoff(t + ZONE_DAY);
+		if (next == off) continue;
+		time_t lo = t, hi = t + ZONE_DAY; // off at lo, next at hi
+		while(hi - lo > 1) {
+			time_t mid = lo + (hi - lo) / 2;
+			if (zone_gmtoff(mid) == off) lo = mid;
+			else hi = mid;
+		}
+		z->at[z->count] = hi;
+		z->offset[z->count] = next;
+		z->count++;
+		off = next;
+	}
+}
+
+// Parse and work out the list of zones, starting at from (POSIX seconds).
+// Returns 0 on success. Run this before there are any other threads.
+static inline int zone_load(const char *spec, long long from) {
+	// tzset() doesn't complain about zones it's never heard of - it just
+	// uses UTC. So make sure there's a file for each.
+	const char *tzdir = getenv("TZDIR");
+	if (tzdir == NULL) tzdir = "/usr/share/zoneinfo";
+	const char *tz = getenv("TZ");
+	if (tz) {
+		snprintf(zone_local_buf, sizeof(zone_local_buf), "%s", tz);
+		zone_local_tz = zone_local_buf;
+	}
+	zone_count = 0;
+	const char *p = spec;
+	while(*p) {
+		if (zone_count == ZONE_MAX) return -1;
+		struct zone *z = &zone_table[zone_count];
+		size_t len = strcspn(p, ",");
+		if (len == 0 || len >= sizeof(z->name)) return -1;
+		memcpy(z->name, p, len);
+		z->name[len] = 0;
+		p += len;
+		if (*p == ',') p++;
+		if (strcmp(z->name, "local") && strcmp(z->name, "UTC")) {
+			char path[256];
+			snprintf(path, sizeof(path), "%s/%s", tzdir, z->name);
+			if (access(path, R_OK)) return -1;
+		}
+		zone_scan(z, from - ZONE_DAY);
+		zone_count++;
+	}
+	// And back to where we started.
+	zone_set_tz(zone_local_tz);
+	return zone_count?0:-1;
+}
+
+// The offset (seconds east) of zone z at the POSIX second t. Ticks go
+// forward, so this is almost always one compare.
+static inline int zone_offset(struct zone *z, long long t) {
+	int i = z->cur;
+	while(i + 1 < z->count && t >= z->at[i + 1]) i++;
+	while(i > 0 && t < z->at[i]) i--;
+	z->cur = i;
+	return z->offset[i];
+}
+
+// Which zone is up at the POSIX second t.
+static inline int zone_which(long long t) {
+	return (int)((t / zone_rotate) % zone_count);
+}
+
+#endif